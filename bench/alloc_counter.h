@@ -0,0 +1,27 @@
+// Replaces the global operator new and delete with versions that count every
+// allocation, so a benchmark can read the count before and after a stage.
+// Include it from one translation unit of a benchmark only
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+static size_t allocations = 0;
+
+// The replacements are not inlined, or GCC sees free() of a pointer from new
+__attribute__((noinline)) void* operator new(size_t size) {
+	allocations++;
+	if (void* pointer = std::malloc(size != 0 ? size : 1)) {
+		return pointer;
+	}
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* pointer) noexcept {
+	std::free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void* pointer, size_t) noexcept {
+	std::free(pointer);
+}
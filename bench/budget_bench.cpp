@@ -0,0 +1,318 @@
+// Runs random and adversarial expressions through a Calculator, the way the
+// command line evaluates and prints a line, and checks that each one stays
+// within a budget of heap allocations, stack use and time per byte. The adversarial corpora are the inputs that used to be slow rather
+// than wrong: deep nesting, huge literals and long chains of operators. Prints
+// the worst input of every corpus as tab separated values and exits with 1 if
+// any input is over budget. With --write file the corpora are written to file,
+// one expression per line, instead of being run
+#include "../calculator.h"
+#include "alloc_counter.h"
+
+#include <chrono>
+#include <fstream>
+#include <random>
+
+// The stack below the caller is filled with a pattern before an input runs,
+// the lowest byte that lost it is as deep as the input went. The bounds are
+// kept as integers, since the painted array is gone once PaintStack() returns
+constexpr size_t STACK_PROBE_SIZE = 1 << 20;
+constexpr unsigned char STACK_PATTERN = 0xA5;
+static uintptr_t stack_low = 0;
+static uintptr_t stack_high = 0;
+
+__attribute__((noinline)) void PaintStack() {
+	unsigned char area[STACK_PROBE_SIZE];
+	std::memset(area, STACK_PATTERN, sizeof(area));
+	// Keeps the compiler from dropping the stores to a dead array
+	asm volatile("" : : "r"(area) : "memory");
+	stack_low = reinterpret_cast<uintptr_t>(area);
+	stack_high = stack_low + sizeof(area);
+}
+
+// Bytes of stack used since PaintStack() was called from the same frame
+__attribute__((noinline)) size_t MeasureStack() {
+	uintptr_t address = stack_low;
+	while (address < stack_high && *reinterpret_cast<const volatile unsigned char*>(address) == STACK_PATTERN) {
+		address++;
+	}
+	return stack_high - address;
+}
+
+// Discards the results without the allocations of a string stream
+class NullBuffer : public std::streambuf {
+protected:
+	int overflow(int ch) override {
+		return ch;
+	}
+
+	std::streamsize xsputn(const char*, std::streamsize count) override {
+		return count;
+	}
+};
+
+// Limits for one expression. The first evaluation may grow the arena and
+// buffers, so it is allowed a few allocations for every page of input. Once
+// they are in place an evaluation must not allocate. Recursion is capped by
+// RECURSION_LIMIT, so the stack never depends on the input
+struct Budget {
+	size_t first_allocations = 64;
+	size_t allocations_per_page = 1;
+	size_t repeat_allocations = 0;
+	size_t stack_bytes = 256 * 1024;
+};
+
+// Time allowed for one expression of a corpus, fixed_ns + ns_per_byte * bytes.
+// The limits are twice the worst of three runs of this benchmark on one core
+// of an x86-64 build machine: fixed_ns from the slowest input under 1 KiB
+// and ns_per_byte from the slowest input per byte of those from 1 KiB up. A
+// stage that turns worse than linear, or a regression of more than half the
+// speed, goes over them
+struct TimeBudget {
+	double fixed_ns;
+	double ns_per_byte;
+};
+
+struct Measurement {
+	size_t first_allocations;
+	size_t repeat_allocations;
+	size_t stack_bytes;
+	double ns;
+};
+
+struct Corpus {
+	const char* name;
+	TimeBudget time;
+	std::vector<std::string> expressions;
+};
+
+const char* const VARIABLES[] = {"x", "y", "z", "w"};
+
+std::string RandomLiteral(std::mt19937& rng) {
+	std::string literal = std::to_string(rng() % 1000);
+	if (rng() % 2 == 0) {
+		literal += '.';
+		literal += std::to_string(rng() % 1000);
+	}
+	return literal;
+}
+
+// An expression of every operator and function, which is sometimes made
+// invalid by dropping or repeating a character
+std::string RandomExpression(std::mt19937& rng, size_t depth) {
+	if (depth == 0 || rng() % 5 == 0) {
+		return rng() % 2 == 0 ? std::string(VARIABLES[rng() % 4]) : RandomLiteral(rng);
+	}
+	std::string operand = RandomExpression(rng, depth - 1);
+	switch (rng() % 10) {
+	case 0:
+		return "-" + operand;
+	case 1:
+		return std::string(rng() % 2 == 0 ? "sqrt(" : rng() % 2 == 0 ? "exp(" : "log(") + operand + ")";
+	case 2:
+		return std::string(rng() % 2 == 0 ? "min(" : "max(") + operand + ", " + RandomExpression(rng, depth - 1) + ")";
+	case 3:
+		return "(" + operand + ")";
+	default:
+		return operand + " " + "+-*/%^"[rng() % 6] + " " + RandomExpression(rng, depth - 1);
+	}
+}
+
+std::string Mutate(std::mt19937& rng, std::string source) {
+	if (!source.empty() && rng() % 4 == 0) {
+		size_t position = rng() % source.size();
+		if (rng() % 2 == 0) {
+			source.erase(position, 1);
+		} else {
+			source.insert(position, 1, source[position]);
+		}
+	}
+	return source;
+}
+
+std::string Repeat(std::string_view text, size_t count) {
+	std::string result;
+	result.reserve(text.size() * count);
+	for (size_t i = 0; i < count; i++) {
+		result += text;
+	}
+	return result;
+}
+
+// Joins count copies of operand with the operator between them
+std::string Chain(std::string_view operand, std::string_view op, size_t count) {
+	std::string result(operand);
+	for (size_t i = 1; i < count; i++) {
+		result += op;
+		result += operand;
+	}
+	return result;
+}
+
+std::vector<Corpus> GenerateCorpora() {
+	std::mt19937 rng(42);
+	std::vector<Corpus> corpora;
+
+	Corpus random{"random", {24000, 0}, {}};
+	for (size_t i = 0; i < 5000; i++) {
+		random.expressions.push_back(Mutate(rng, RandomExpression(rng, 1 + rng() % 8)));
+	}
+	corpora.push_back(random);
+
+	Corpus nesting{"nesting", {16000, 48}, {}};
+	for (size_t depth : {size_t(10), size_t(1000), DEFAULT_MAX_DEPTH, DEFAULT_MAX_DEPTH + 1, size_t(1000000)}) {
+		nesting.expressions.push_back(Repeat("(", depth) + "1" + Repeat(")", depth));
+		nesting.expressions.push_back(Repeat("(", depth) + "1");
+		nesting.expressions.push_back(Repeat("sqrt(", depth) + "x" + Repeat(")", depth));
+		nesting.expressions.push_back(Repeat("min(1,", depth) + "x" + Repeat(")", depth));
+	}
+	nesting.expressions.push_back(Repeat(")", 1000000));
+	corpora.push_back(nesting);
+
+	Corpus literals{"literals", {2600, 42}, {}};
+	for (size_t digits : {100, 10000, 1000000}) {
+		literals.expressions.push_back(Repeat("9", digits));
+		literals.expressions.push_back("0." + Repeat("0", digits) + "1");
+		literals.expressions.push_back(Repeat("0", digits) + "1.5");
+		literals.expressions.push_back("1." + Repeat("3", digits) + " * x");
+		literals.expressions.push_back(Repeat("1", digits) + "." + Repeat("1", digits) + "." + "1");
+	}
+	literals.expressions.push_back(Chain("123.456", "+", 100000));
+	corpora.push_back(literals);
+
+	Corpus chains{"chains", {38000, 432}, {}};
+	for (size_t length : {100, 10000, 1000000}) {
+		chains.expressions.push_back(Chain("1", "-", length));
+		chains.expressions.push_back(Chain("x", "-", length));
+		chains.expressions.push_back(Repeat("-", length) + "x");
+		chains.expressions.push_back(Chain("x", "--", length));
+		chains.expressions.push_back(Chain("2", "^", length));
+		chains.expressions.push_back(Chain("(x+1)", "*", length));
+		chains.expressions.push_back(Repeat("-", length));
+	}
+	corpora.push_back(chains);
+
+	Corpus garbage{"garbage", {2000, 12}, {}};
+	for (size_t length : {100, 10000, 1000000}) {
+		garbage.expressions.push_back(Repeat("a", length));
+		garbage.expressions.push_back(Repeat(" ", length) + "1");
+		garbage.expressions.push_back(Repeat("1 ", length));
+		garbage.expressions.push_back(Repeat("$", length));
+		garbage.expressions.push_back(Repeat(",", length));
+		garbage.expressions.push_back(Chain("foo(1)", "+", length / 8));
+	}
+	corpora.push_back(garbage);
+	return corpora;
+}
+
+// What the command line does with a line of batch input
+template <typename Number>
+void ProcessLine(std::string_view expression, Calculator<Number>& calculator, std::ostream& out) {
+	Number result;
+	if (Error error = calculator.Evaluate(expression, result)) {
+		out << error << '\n';
+	} else {
+		out << result << '\n';
+	}
+}
+
+template <typename Number>
+Measurement MeasureExpression(const std::string& expression, Calculator<Number>& calculator, std::ostream& out, int repetitions) {
+	Measurement measurement;
+	size_t before = allocations;
+	ProcessLine(expression, calculator, out);
+	measurement.first_allocations = allocations - before;
+	// The arena merges the blocks it grew into one on the next reset
+	ProcessLine(expression, calculator, out);
+
+	PaintStack();
+	before = allocations;
+	ProcessLine(expression, calculator, out);
+	measurement.repeat_allocations = allocations - before;
+	measurement.stack_bytes = MeasureStack();
+
+	measurement.ns = std::numeric_limits<double>::infinity();
+	for (int r = 0; r < repetitions; r++) {
+		auto start = std::chrono::steady_clock::now();
+		ProcessLine(expression, calculator, out);
+		auto end = std::chrono::steady_clock::now();
+		measurement.ns = std::min(measurement.ns, std::chrono::duration<double, std::nano>(end - start).count());
+	}
+	return measurement;
+}
+
+// Names what an input is over budget on, or returns nullptr
+const char* CheckBudget(const Budget& budget, const TimeBudget& time, const Measurement& measurement, size_t bytes) {
+	if (measurement.first_allocations > budget.first_allocations + bytes / 4096 * budget.allocations_per_page) {
+		return "allocations";
+	}
+	if (measurement.repeat_allocations > budget.repeat_allocations) {
+		return "repeated allocations";
+	}
+	if (measurement.stack_bytes > budget.stack_bytes) {
+		return "stack";
+	}
+	if (measurement.ns > time.fixed_ns + time.ns_per_byte * bytes) {
+		return "time";
+	}
+	return nullptr;
+}
+
+// The cache is off, so every evaluation runs the whole pipeline from the lexer
+// to the VM rather than looking the program up
+bool RunCorpus(const Corpus& corpus, const Budget& budget, int repetitions) {
+	CalculatorOptions options;
+	options.cache_size = 0;
+	Calculator<float> calculator(options);
+	for (size_t i = 0; i < 4; i++) {
+		calculator.SetVariable(VARIABLES[i], 1.5f + i);
+	}
+	NullBuffer buffer;
+	std::ostream out(&buffer);
+	out.precision(NumberTraits<float>::PRECISION);
+
+	bool passed = true;
+	Measurement worst{0, 0, 0, 0};
+	double worst_ns_per_byte = 0;
+	size_t bytes = 0;
+	for (const std::string& expression : corpus.expressions) {
+		Measurement measurement = MeasureExpression(expression, calculator, out, repetitions);
+		if (const char* over = CheckBudget(budget, corpus.time, measurement, expression.size())) {
+			std::cerr << corpus.name << ": over the " << over << " budget with " << measurement.first_allocations << " + "
+					  << measurement.repeat_allocations << " allocations, " << measurement.stack_bytes << " bytes of stack and "
+					  << measurement.ns << " ns for " << expression.size() << " bytes: " << expression.substr(0, 60) << "\n";
+			passed = false;
+		}
+		bytes += expression.size();
+		worst.first_allocations = std::max(worst.first_allocations, measurement.first_allocations);
+		worst.repeat_allocations = std::max(worst.repeat_allocations, measurement.repeat_allocations);
+		worst.stack_bytes = std::max(worst.stack_bytes, measurement.stack_bytes);
+		worst.ns = std::max(worst.ns, measurement.ns);
+		worst_ns_per_byte = std::max(worst_ns_per_byte, measurement.ns / std::max<size_t>(expression.size(), 1));
+	}
+	std::cout << corpus.name << '\t' << corpus.expressions.size() << '\t' << bytes << '\t' << worst.first_allocations << '\t'
+			  << worst.repeat_allocations << '\t' << worst.stack_bytes << '\t' << worst.ns << '\t' << worst_ns_per_byte << '\t'
+			  << (passed ? "pass" : "fail") << '\n';
+	return passed;
+}
+
+int main(int argc, char** argv) {
+	std::vector<Corpus> corpora = GenerateCorpora();
+	if (argc == 3 && std::string_view(argv[1]) == "--write") {
+		std::ofstream file(argv[2], std::ios::binary);
+		for (const Corpus& corpus : corpora) {
+			for (const std::string& expression : corpus.expressions) {
+				file << expression << '\n';
+			}
+		}
+		return file ? 0 : 1;
+	}
+
+	const int repetitions = 3;
+	Budget budget;
+	bool passed = true;
+	std::cout << "corpus\texpressions\tbytes\tmax_first_allocations\tmax_repeat_allocations\tmax_stack_bytes\tmax_ns\tmax_ns_per_byte\tresult\n";
+	for (const Corpus& corpus : corpora) {
+		passed = RunCorpus(corpus, budget, repetitions) && passed;
+	}
+	return passed ? 0 : 1;
+}
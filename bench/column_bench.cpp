@@ -0,0 +1,169 @@
+// Compares evaluating compiled expressions over a million rows of variable
+// values row by row (tree walk and VM) against the columnar evaluator, for
+// plain arithmetic, for the math functions and for constants of -0. Then checks
+// that the tree walk, the VM, the columns and the JIT give the same bits on
+// every combination of zeros of both signs, infinities, NaNs and values that
+// overflow or underflow the operators
+#include "../calculator.h"
+
+#include <chrono>
+#include <cstring>
+#include <random>
+
+template <typename Function>
+double MeasureSeconds(Function function) {
+	auto start = std::chrono::steady_clock::now();
+	function();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(end - start).count();
+}
+
+// Every evaluator that supports the expression, on every row of the columns
+bool CheckSpecialValues() {
+	const float special[] = {0.0f, -0.0f, 1.0f, -2.5f, 1e30f, 1e-30f, INFINITY, -INFINITY, NAN, -NAN};
+	const size_t count = sizeof(special) / sizeof(special[0]);
+	const char* const sources[] = {"(2.5-x)^(2.5-a) - (2.5-x)%(2.5-b)*c", "sqrt(a)*log(b) + exp(c)/x",
+								   "min(a, b/x) - max(-c, x%a)", "-(a/b) * (c-x)^0.5 + (x^a)%(b^c)",
+								   "a%b + x%(a*b) + (c*c*c)%x", "a/b - c*x + (a-b)/(c-x) - -x"};
+
+	SymbolTable symbols;
+	const char* names[] = {"a", "b", "c", "x"};
+	std::vector<std::vector<float>> values(4);
+	for (size_t slot = 0; slot < 4; slot++) {
+		symbols.Declare(names[slot]);
+	}
+	// Every combination of the special values, the last variable changing fastest
+	size_t rows = count * count * count * count;
+	for (size_t row = 0; row < rows; row++) {
+		for (size_t slot = 0, index = row; slot < 4; slot++, index /= count) {
+			values[3 - slot].push_back(special[index % count]);
+		}
+	}
+	const float* columns[4] = {values[0].data(), values[1].data(), values[2].data(), values[3].data()};
+
+	for (const char* source : sources) {
+		Lexer lexer(source);
+		lexer.Scan();
+		Parser parser(lexer.GetTokens(), source, symbols);
+		parser.Parse();
+		parser.Optimize();
+		Program program;
+		if (Error error = Compile(source, symbols, program)) {
+			std::cout << error << "\n";
+			return false;
+		}
+		JitFunction jit;
+		bool jitted = jit.Compile(program);
+
+		std::vector<float> column_results(rows);
+		ColumnEvaluator evaluator;
+		evaluator.Execute(program, columns, column_results.data(), rows);
+		VirtualMachine vm;
+		for (size_t row = 0; row < rows; row++) {
+			float slots[4] = {values[0][row], values[1][row], values[2][row], values[3][row]};
+			float results[3] = {parser.GetAST()->Evaluate(slots), vm.Execute(program, slots), jitted ? jit(slots) : 0};
+			const char* const evaluators[] = {"tree", "vm", "jit"};
+			for (size_t i = 0; i < (jitted ? 3 : 2); i++) {
+				if (std::memcmp(&results[i], &column_results[row], sizeof(float)) != 0) {
+					std::cout << source << " with a=" << slots[0] << " b=" << slots[1] << " c=" << slots[2] << " x=" << slots[3]
+							  << ": " << evaluators[i] << " gives " << results[i] << ", columns give " << column_results[row] << "\n";
+					return false;
+				}
+			}
+		}
+	}
+	std::cout << "special values: " << sizeof(sources) / sizeof(sources[0]) << " expressions agree on " << rows << " rows\n";
+	return true;
+}
+
+int main() {
+	const size_t rows = 1000000;
+	const int repetitions = 10;
+	const char* const sources[] = {"(a*x + b) / (x - a*2) * c + 3*x - b/4",
+								   "sqrt(a*a + b*b) * exp(-x*x/5000) + log(max(c, 1)) - min(a, b) % 7",
+								   // Only the sign of the folded -0 constants decides these divisions
+								   "x / (1 + exp(a/(0*(0-1)))) - min(b/(-0), 1)"};
+
+	SymbolTable symbols;
+	const char* names[] = {"a", "b", "c", "x"};
+	std::vector<std::vector<float>> values;
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> distribution(-100, 100);
+	for (const char* name : names) {
+		symbols.Declare(name);
+		values.emplace_back(rows);
+		for (float& value : values.back()) {
+			value = distribution(rng);
+		}
+	}
+
+	for (const char* source : sources) {
+		// The tree walker needs the AST, so parse it directly
+		Lexer lexer(source);
+		lexer.Scan();
+		Parser parser(lexer.GetTokens(), source, symbols);
+		parser.Parse();
+		parser.Optimize();
+		const Expression<>* ast = parser.GetAST();
+
+		Program program;
+		if (Error error = Compile(source, symbols, program)) {
+			std::cout << error << "\n";
+			return 1;
+		}
+
+		std::vector<float> tree_results(rows);
+		std::vector<float> vm_results(rows);
+		std::vector<float> column_results(rows);
+		float slots[4];
+
+		double tree_seconds = MeasureSeconds([&]() {
+			for (int r = 0; r < repetitions; r++) {
+				for (size_t row = 0; row < rows; row++) {
+					for (size_t slot = 0; slot < 4; slot++) {
+						slots[slot] = values[slot][row];
+					}
+					tree_results[row] = ast->Evaluate(slots);
+				}
+			}
+		});
+
+		VirtualMachine vm;
+		double vm_seconds = MeasureSeconds([&]() {
+			for (int r = 0; r < repetitions; r++) {
+				for (size_t row = 0; row < rows; row++) {
+					for (size_t slot = 0; slot < 4; slot++) {
+						slots[slot] = values[slot][row];
+					}
+					vm_results[row] = vm.Execute(program, slots);
+				}
+			}
+		});
+
+		ColumnEvaluator evaluator;
+		const float* columns[4];
+		for (size_t slot = 0; slot < 4; slot++) {
+			columns[slot] = values[slot].data();
+		}
+		double column_seconds = MeasureSeconds([&]() {
+			for (int r = 0; r < repetitions; r++) {
+				evaluator.Execute(program, columns, column_results.data(), rows);
+			}
+		});
+
+		double evaluations = static_cast<double>(rows) * repetitions;
+		std::cout << "expression:   " << source << "\n";
+		std::cout << "tree:         " << tree_seconds * 1e9 / evaluations << " ns/row\n";
+		std::cout << "vm:           " << vm_seconds * 1e9 / evaluations << " ns/row\n";
+		std::cout << "columns:      " << column_seconds * 1e9 / evaluations << " ns/row\n";
+		std::cout << "speedup:      " << tree_seconds / column_seconds << "x over tree, " << vm_seconds / column_seconds << "x over vm\n";
+
+		// All three use the same float operations in the same order
+		if (std::memcmp(tree_results.data(), column_results.data(), rows * sizeof(float)) != 0 ||
+			std::memcmp(vm_results.data(), column_results.data(), rows * sizeof(float)) != 0) {
+			std::cout << "Results differ between evaluators\n";
+			return 1;
+		}
+	}
+	return CheckSpecialValues() ? 0 : 1;
+}
@@ -0,0 +1,196 @@
+// Checks that calc:: formulas give the same results as the same expressions
+// parsed, compiled and run on the VM, for random values of their variables,
+// and times both, and checks the errors of calc::eval and the node counts of
+// the optimizer. Exits with 1 if any of them differs. The constant evaluator
+// and formulas must also still run in constant expressions, or this fails to
+// compile
+#include "../calculator.h"
+
+#include <chrono>
+#include <random>
+
+static_assert(calc::eval("(3+5)/2") == 4.0f);
+static_assert(calc::eval<double>("1.5 * (2 - 0.5)") == 2.25);
+static_assert(((calc::lit(3) + calc::lit(5)) / 2).Evaluate() == 4.0f);
+static_assert(calc::eval("-2 * -(3 - 5)") == -4.0f && calc::eval("max(1, 7) - min(2, 3)") == 5.0f);
+static_assert(calc::eval<double>("log(exp(1))") == 1.0 && calc::eval("exp(0)") == 1.0f);
+static_assert((calc::max(calc::lit(2), 10) - calc::min(calc::lit(3), 24)).Evaluate() == 7.0f);
+static_assert([]() {
+	float result = 0;
+	Error error = calc::eval("2 * (3 + x)", result);
+	return error.type == Error::Type::UNKNOWN_VARIABLE && error.location == 9;
+}());
+
+// Library calls that only GCC folds
+#if defined(__GNUC__) && !defined(__clang__)
+static_assert(calc::eval("-2^2") == -4.0f && calc::eval("2^3^2") == 512.0f);
+static_assert(calc::eval<double>("max(1, 7 % 4) + sqrt(16)") == 7.0);
+static_assert((calc::pow(calc::lit(2), 10) - calc::min(calc::lit(3), 24)).Evaluate() == 1021.0f);
+#endif
+
+template <typename Function>
+double MeasureSeconds(Function function) {
+	auto start = std::chrono::steady_clock::now();
+	function();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(end - start).count();
+}
+
+// Equal to the bit, or both NaN. The payload of a NaN is not compared
+template <typename Number>
+bool IsSame(Number lhs, Number rhs) {
+	return (lhs == rhs && std::signbit(lhs) == std::signbit(rhs)) || (lhs != lhs && rhs != rhs);
+}
+
+template <typename Number, typename Formula>
+bool CompareFormula(const char* source, Formula formula, const std::vector<std::vector<Number>>& values) {
+	const char* names[] = {"a", "b", "c", "x"};
+	SymbolTable symbols;
+	for (const char* name : names) {
+		symbols.Declare(name);
+	}
+	Program<Number> program;
+	if (Error error = Compile(source, symbols, program)) {
+		std::cout << error << "\n";
+		return false;
+	}
+
+	const size_t rows = values[0].size();
+	std::vector<Number> formula_results(rows);
+	std::vector<Number> vm_results(rows);
+	Number slots[4];
+	double formula_seconds = MeasureSeconds([&]() {
+		for (size_t row = 0; row < rows; row++) {
+			for (size_t slot = 0; slot < 4; slot++) {
+				slots[slot] = values[slot][row];
+			}
+			formula_results[row] = formula(slots);
+		}
+	});
+
+	VirtualMachine<Number> vm;
+	double vm_seconds = MeasureSeconds([&]() {
+		for (size_t row = 0; row < rows; row++) {
+			for (size_t slot = 0; slot < 4; slot++) {
+				slots[slot] = values[slot][row];
+			}
+			vm_results[row] = vm.Execute(program, slots);
+		}
+	});
+
+	std::cout << "expression:   " << source << " (" << (sizeof(Number) == sizeof(float) ? "float" : "double") << ")\n";
+	std::cout << "formula:      " << formula_seconds * 1e9 / rows << " ns/row\n";
+	std::cout << "vm:           " << vm_seconds * 1e9 / rows << " ns/row\n";
+	for (size_t row = 0; row < rows; row++) {
+		if (!IsSame(formula_results[row], vm_results[row])) {
+			std::cout << "Results differ at row " << row << ": " << formula_results[row] << " and " << vm_results[row] << "\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Every operator and function, with variables on both sides of each so that
+// nothing is folded away
+template <typename Number>
+bool CompareFormulas(size_t rows) {
+	std::vector<std::vector<Number>> values(4, std::vector<Number>(rows));
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<Number> distribution(-100, 100);
+	for (std::vector<Number>& column : values) {
+		for (Number& value : column) {
+			value = distribution(rng);
+		}
+	}
+
+	auto a = calc::var<0>();
+	auto b = calc::var<1>();
+	auto c = calc::var<2>();
+	auto x = calc::var<3>();
+	bool passed = true;
+	passed = CompareFormula("(a*x + b) / (x - a*2) * c + 3*x - b/4", (a * x + b) / (x - a * 2) * c + 3 * x - b / 4, values) && passed;
+	passed = CompareFormula("-a % b + c ^ 0.5 * x ^ 2", -a % b + calc::pow(c, 0.5) * calc::pow(x, 2), values) && passed;
+	passed = CompareFormula("max(a, c) * min(b, x) - (a % 7) ^ (b / 25)", calc::max(a, c) * calc::min(b, x) - calc::pow(a % 7, b / 25), values) &&
+			 passed;
+	passed = CompareFormula("exp(b / 100) - log(max(c, 1)) + sqrt(min(a, x)) * 2 ^ (x / 50)",
+							calc::exp(b / 100) - calc::log(calc::max(c, 1)) + calc::sqrt(calc::min(a, x)) * calc::pow(2, x / 50), values) &&
+			 passed;
+	return passed;
+}
+
+// The overload of calc::eval that returns an Error, called at run time
+bool CheckErrors() {
+	float result = 0;
+	if (Error error = calc::eval("(3+5)/2", result); error || result != 4.0f) {
+		std::cout << "calc::eval(\"(3+5)/2\") failed: " << error << "\n";
+		return false;
+	}
+	const char* const sources[] = {"2 * (3 + x)", "1 +", "max(1)", "2 $ 3"};
+	Error errors[] = {calc::eval("2 * (3 + x)", result), calc::eval("1 +", result), calc::eval("max(1)", result),
+					  calc::eval("2 $ 3", result)};
+	Error::Type types[] = {Error::Type::UNKNOWN_VARIABLE, Error::Type::END_OF_STREAM, Error::Type::INVALID_TOKEN,
+						   Error::Type::INVALID_CHAR};
+	for (size_t i = 0; i < 4; i++) {
+		if (errors[i].type != types[i]) {
+			std::cout << "calc::eval(\"" << sources[i] << "\") gives the wrong error: " << errors[i] << "\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Only x + -0 and x - 0 are exact identities for a zero x, the other ways of
+// adding or subtracting a zero must not be simplified away
+template <typename Number>
+bool CompareSignedZeros() {
+	const Number special[] = {Number(0), -Number(0), Number(1), -Number(2.5)};
+	std::vector<std::vector<Number>> values(4);
+	for (size_t row = 0; row < 16; row++) {
+		for (size_t slot = 0; slot < 4; slot++) {
+			values[slot].push_back(special[(row >> slot) % 4]);
+		}
+	}
+
+	auto a = calc::var<0>();
+	bool passed = true;
+	passed = CompareFormula("a + 0", a + 0, values) && passed;
+	passed = CompareFormula("0 + a", 0 + a, values) && passed;
+	passed = CompareFormula("a + -0", a + -0.0, values) && passed;
+	passed = CompareFormula("a - 0", a - 0, values) && passed;
+	passed = CompareFormula("a - -0", a - -0.0, values) && passed;
+	return passed;
+}
+
+// The optimizer reports how many nodes the tree lost, shared nodes included once
+bool CheckRemovedNodes() {
+	struct Case {
+		const char* source;
+		size_t removed;
+	};
+	const Case cases[] = {{"(2*3)+(2*3)", 3}, {"1-1-1-1", 3}, {"x + -0", 3}, {"x*1*1+(2-2)", 4}, {"(x+1)*(x+1)", 0}};
+	SymbolTable symbols;
+	symbols.Declare("x");
+	for (const Case& test : cases) {
+		Lexer<> lexer(test.source);
+		lexer.Scan();
+		Parser<> parser(lexer.GetTokens(), test.source, symbols);
+		parser.Parse();
+		size_t removed = parser.Optimize();
+		if (removed != test.removed) {
+			std::cout << "Optimizing " << test.source << " removed " << removed << " nodes instead of " << test.removed << "\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+int main() {
+	const size_t rows = 1000000;
+	bool passed = CheckErrors();
+	passed = CheckRemovedNodes() && passed;
+	passed = CompareFormulas<float>(rows) && passed;
+	passed = CompareFormulas<double>(rows) && passed;
+	passed = CompareSignedZeros<float>() && passed;
+	passed = CompareSignedZeros<double>() && passed;
+	return passed ? 0 : 1;
+}
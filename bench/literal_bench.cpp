@@ -0,0 +1,162 @@
+// Compares literal parsing in Lexer::GetLiteral against the old
+// std::stof(std::string(...)) approach on literal dense input, and times
+// Lexer::Scan on that and on a generated line of names and whitespace. Scan
+// is checked against lexing one token at a time with Lexer::Next on random
+// sources, exits with 1 if they differ
+#include "../calculator.h"
+
+#include <chrono>
+#include <random>
+
+std::string GenerateLiterals(size_t count) {
+	std::mt19937 rng(42);
+	std::uniform_int_distribution<int> integer(0, 99999);
+	std::uniform_int_distribution<int> fraction(0, 9999);
+
+	std::string source;
+	for (size_t i = 0; i < count; i++) {
+		if (i != 0) {
+			source += '+';
+		}
+		source += std::to_string(integer(rng));
+		if (i % 2 == 0) {
+			source += '.';
+			source += std::to_string(fraction(rng));
+		}
+	}
+	return source;
+}
+
+// Names, literals, operators and whitespace as the expression generators write
+// them, most of the bytes are not tokens
+std::string GenerateLine(size_t count) {
+	std::mt19937 rng(42);
+	std::string source;
+	for (size_t i = 0; i < count; i++) {
+		if (i != 0) {
+			source += "\n    ";
+			source += "+-*/"[rng() % 4];
+			source += ' ';
+		}
+		source += "(temperature_" + std::to_string(rng() % 10) + " * coefficient_" + std::to_string(rng() % 10);
+		source += "   +  " + std::to_string(rng() % 1000) + ".5)";
+	}
+	return source;
+}
+
+// Sources of random characters, valid or not, long enough to span several
+// blocks of the scanner
+bool CheckScan() {
+	const char alphabet[] = "0123456789..xyz_E+-*/^%,()  \t\n#\x80";
+	std::mt19937 rng(7);
+	for (size_t test = 0; test < 100000; test++) {
+		std::string source(rng() % 300, ' ');
+		for (char& ch : source) {
+			ch = alphabet[rng() % (sizeof(alphabet) - 1)];
+		}
+
+		Lexer<> scanner(source);
+		Error error = scanner.Scan();
+		const TokenBuffer<>& tokens = scanner.GetTokens();
+
+		Lexer<> lexer(source);
+		Token<> token(TokenType::ADD);
+		size_t position = 0;
+		Error expected(Error::Type::NO_ERROR, 0, source);
+		size_t index = 0, literal_index = 0, name_index = 0;
+		bool same = true;
+		while (same && lexer.Next(token, position, expected)) {
+			same = index < tokens.GetSize() && tokens.GetType(index) == token.token_type && tokens.GetPosition(index) == position;
+			if (same && token.token_type == TokenType::LITERAL) {
+				same = tokens.GetLiteral(literal_index++) == token.literal_value;
+			} else if (same && token.token_type == TokenType::IDENTIFIER) {
+				same = tokens.GetName(name_index++) == token.name;
+			}
+			index++;
+		}
+		same = same && index == tokens.GetSize() && error.type == expected.type && error.location == expected.location;
+		if (!same) {
+			std::cout << "Lexer::Scan differs from Lexer::Next on \"" << source << "\"\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+template <typename Function>
+double MeasureSeconds(Function function) {
+	auto start = std::chrono::steady_clock::now();
+	function();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(end - start).count();
+}
+
+int main() {
+	const size_t literal_count = 1000000;
+	const int repetitions = 5;
+	std::string source = GenerateLiterals(literal_count);
+
+	// Literal spans in the source, found once up front so both methods only
+	// measure the conversion itself
+	std::vector<std::string_view> literals;
+	size_t start = 0;
+	for (size_t i = 0; i <= source.size(); i++) {
+		if (i == source.size() || source[i] == '+') {
+			literals.push_back(std::string_view(source).substr(start, i - start));
+			start = i + 1;
+		}
+	}
+
+	float checksum_stof = 0;
+	double stof_seconds = MeasureSeconds([&]() {
+		for (int r = 0; r < repetitions; r++) {
+			for (std::string_view literal : literals) {
+				checksum_stof += std::stof(std::string(literal));
+			}
+		}
+	});
+
+	float checksum_from_chars = 0;
+	double from_chars_seconds = MeasureSeconds([&]() {
+		for (int r = 0; r < repetitions; r++) {
+			for (std::string_view literal : literals) {
+				float value;
+				std::from_chars(literal.data(), literal.data() + literal.size(), value);
+				checksum_from_chars += value;
+			}
+		}
+	});
+
+	size_t token_count = 0;
+	double scan_seconds = MeasureSeconds([&]() {
+		for (int r = 0; r < repetitions; r++) {
+			Lexer lexer(source);
+			lexer.Scan();
+			token_count += lexer.GetTokens().GetSize();
+		}
+	});
+
+	std::string line = GenerateLine(100000);
+	double line_seconds = MeasureSeconds([&]() {
+		for (int r = 0; r < repetitions; r++) {
+			Lexer lexer(line);
+			lexer.Scan();
+			token_count += lexer.GetTokens().GetSize();
+		}
+	});
+
+	double conversions = static_cast<double>(literals.size()) * repetitions;
+	std::cout << "literals:           " << literals.size() << " (" << source.size() << " bytes)\n";
+	std::cout << "stof + copy:        " << stof_seconds * 1e9 / conversions << " ns/literal\n";
+	std::cout << "from_chars:         " << from_chars_seconds * 1e9 / conversions << " ns/literal\n";
+	std::cout << "speedup:            " << stof_seconds / from_chars_seconds << "x\n";
+	std::cout << "Lexer::Scan:        " << source.size() * repetitions / scan_seconds / 1e6 << " MB/s\n";
+	std::cout << "Lexer::Scan line:   " << line.size() * repetitions / line_seconds / 1e6 << " MB/s (" << line.size()
+			  << " bytes)\n";
+
+	if (checksum_stof != checksum_from_chars) {
+		std::cout << "Results differ between stof and from_chars\n";
+		return 1;
+	}
+	return CheckScan() && token_count != 0 ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+// Compares Expression::Evaluate against ParallelEvaluator on expressions of
+// millions of nodes: a wide balanced tree, a deep spine of operators whose
+// other operands are large balanced subtrees and a tree whose two halves are
+// written out equal at every level, which the parser shares. Checks both give
+// the same result
+#include "../calculator.h"
+
+#include <chrono>
+#include <random>
+
+template <typename Function>
+double MeasureSeconds(Function function) {
+	auto start = std::chrono::steady_clock::now();
+	function();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(end - start).count();
+}
+
+// Operators are chosen so values stay near one and the results stay finite
+void AppendBalanced(std::mt19937& rng, size_t leaves, std::string& source) {
+	if (leaves == 1) {
+		if (rng() % 2 == 0) {
+			source += "xyzw"[rng() % 4];
+		} else {
+			source += std::to_string(1 + rng() % 9);
+			source += '.';
+			source += std::to_string(rng() % 10);
+		}
+		return;
+	}
+	source += '(';
+	AppendBalanced(rng, leaves / 2, source);
+	source += "+-*/"[rng() % 4];
+	AppendBalanced(rng, leaves - leaves / 2, source);
+	source += ')';
+}
+
+std::string GenerateWide(std::mt19937& rng, size_t leaves) {
+	std::string source;
+	AppendBalanced(rng, leaves, source);
+	return source;
+}
+
+// The spine is written left associatively without parentheses, so the parser
+// builds it iteratively however long it is
+std::string GenerateDeep(std::mt19937& rng, size_t length, size_t leaves) {
+	std::string source;
+	AppendBalanced(rng, leaves, source);
+	for (size_t i = 1; i < length; i++) {
+		source += "+-"[rng() % 2];
+		AppendBalanced(rng, leaves, source);
+	}
+	return source;
+}
+
+// Each level repeats the previous one twice, so the source doubles while the
+// parser adds only a few nodes
+std::string GenerateShared(std::mt19937& rng, size_t levels) {
+	std::string source = "x";
+	for (size_t i = 0; i < levels; i++) {
+		char op = "+-*/"[rng() % 4];
+		source = "(" + source + op + "y)" + "+-*/"[rng() % 4] + "(" + source + op + "y)";
+	}
+	return source;
+}
+
+bool Run(const char* name, const std::string& source, int repetitions) {
+	SymbolTable symbols;
+	const char* const variables[] = {"x", "y", "z", "w"};
+	float slots[4];
+	for (size_t i = 0; i < 4; i++) {
+		symbols.Declare(variables[i]);
+		slots[i] = 1.25f + 0.5f * i;
+	}
+
+	Lexer<> lexer(source);
+	if (Error error = lexer.Scan()) {
+		std::cerr << name << ": " << error << "\n";
+		return false;
+	}
+	Parser<> parser(lexer.GetTokens(), source, symbols, 0);
+	if (Error error = parser.Parse()) {
+		std::cerr << name << ": " << error << "\n";
+		return false;
+	}
+	const Expression<>* root = parser.GetAST();
+
+	float expected = 0;
+	double sequential = std::numeric_limits<double>::infinity();
+	for (int r = 0; r < repetitions; r++) {
+		sequential = std::min(sequential, MeasureSeconds([&]() { expected = root->Evaluate(slots); }));
+	}
+
+	std::cout << name << ": " << source.size() << " bytes\n";
+	std::cout << "Expression::Evaluate:       " << sequential * 1e3 << " ms\n";
+	size_t hardware = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	for (size_t threads = 1; threads <= std::max<size_t>(hardware, 4); threads *= 2) {
+		ParallelEvaluator<> evaluator(threads);
+		float result = 0;
+		double parallel = std::numeric_limits<double>::infinity();
+		for (int r = 0; r < repetitions; r++) {
+			parallel = std::min(parallel, MeasureSeconds([&]() { result = evaluator.Evaluate(root, slots); }));
+		}
+		if (std::memcmp(&result, &expected, sizeof(float)) != 0) {
+			std::cout << "ParallelEvaluator gives " << result << " instead of " << expected << "\n";
+			return false;
+		}
+		std::cout << "ParallelEvaluator, " << threads << " threads: " << parallel * 1e3 << " ms, "
+				  << sequential / parallel << "x\n";
+	}
+	return true;
+}
+
+int main() {
+	const int repetitions = 5;
+	std::mt19937 rng(42);
+	if (!Run("wide", GenerateWide(rng, 1 << 21), repetitions)) {
+		return 1;
+	}
+	if (!Run("deep", GenerateDeep(rng, 4096, 512), repetitions)) {
+		return 1;
+	}
+	if (!Run("shared", GenerateShared(rng, 20), repetitions)) {
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,228 @@
+// Times each stage of the pipeline, Lexer::Scan, Parser::Parse and
+// Expression::Evaluate, and the whole of Calculator::Evaluate on generated
+// corpora and counts the heap allocations
+// every stage makes. Results are printed as tab separated values, one line per
+// corpus and stage, so they can be collected and compared between runs
+#include "../calculator.h"
+#include "alloc_counter.h"
+
+#include <chrono>
+#include <random>
+
+volatile float sink;
+
+const char* const VARIABLES[] = {"a", "b", "c", "d", "x", "y", "z", "w"};
+const size_t VARIABLE_COUNT = sizeof(VARIABLES) / sizeof(VARIABLES[0]);
+
+struct Corpus {
+	const char* name;
+	std::vector<std::string> expressions;
+	size_t bytes = 0;
+};
+
+char RandomOperator(std::mt19937& rng) {
+	return "+-*/"[rng() % 4];
+}
+
+std::string RandomLiteral(std::mt19937& rng) {
+	std::string literal = std::to_string(rng() % 10000);
+	if (rng() % 2 == 0) {
+		literal += '.';
+		literal += std::to_string(rng() % 1000);
+	}
+	return literal;
+}
+
+std::string RandomOperand(std::mt19937& rng) {
+	if (rng() % 2 == 0) {
+		return VARIABLES[rng() % VARIABLE_COUNT];
+	}
+	return RandomLiteral(rng);
+}
+
+// A few operands, like the lines typed into the REPL
+std::string GenerateShort(std::mt19937& rng) {
+	std::string source = RandomOperand(rng);
+	size_t operands = 2 + rng() % 4;
+	for (size_t i = 1; i < operands; i++) {
+		source += RandomOperator(rng);
+		source += RandomOperand(rng);
+	}
+	return source;
+}
+
+// Every operator is wrapped in its own parentheses, so the tree is as deep as
+// the expression is long
+std::string GenerateNested(std::mt19937& rng, size_t depth) {
+	std::string source = RandomOperand(rng);
+	for (size_t i = 0; i < depth; i++) {
+		source = '(' + source + RandomOperator(rng) + RandomOperand(rng) + ')';
+	}
+	return source;
+}
+
+std::string GenerateChain(std::mt19937& rng, size_t operands) {
+	std::string source = RandomOperand(rng);
+	for (size_t i = 1; i < operands; i++) {
+		source += RandomOperator(rng);
+		source += RandomOperand(rng);
+	}
+	return source;
+}
+
+std::string GenerateLiterals(std::mt19937& rng, size_t operands) {
+	std::string source = RandomLiteral(rng);
+	for (size_t i = 1; i < operands; i++) {
+		source += RandomOperator(rng);
+		source += RandomLiteral(rng);
+	}
+	return source;
+}
+
+// The same parenthesised term appears several times, which the parser shares
+// and the compiled program computes once
+std::string GenerateRepeated(std::mt19937& rng, size_t operands) {
+	std::string term = '(' + GenerateShort(rng) + ')';
+	std::string source = term;
+	for (size_t i = 1; i < operands; i++) {
+		source += RandomOperator(rng);
+		source += rng() % 2 == 0 ? term : RandomOperand(rng);
+	}
+	return source;
+}
+
+template <typename Generator>
+Corpus GenerateCorpus(const char* name, size_t count, Generator generator) {
+	Corpus corpus;
+	corpus.name = name;
+	for (size_t i = 0; i < count; i++) {
+		corpus.expressions.push_back(generator());
+		corpus.bytes += corpus.expressions.back().size();
+	}
+	return corpus;
+}
+
+struct Measurement {
+	double seconds;
+	size_t allocations;
+};
+
+// Runs a stage over the whole corpus, the first pass counts allocations and
+// the fastest of the following passes is kept
+template <typename Stage>
+Measurement Measure(const Corpus& corpus, int repetitions, Stage stage) {
+	Measurement measurement;
+	size_t before = allocations;
+	for (size_t i = 0; i < corpus.expressions.size(); i++) {
+		stage(i);
+	}
+	measurement.allocations = allocations - before;
+
+	measurement.seconds = std::numeric_limits<double>::infinity();
+	for (int r = 0; r < repetitions; r++) {
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < corpus.expressions.size(); i++) {
+			stage(i);
+		}
+		auto end = std::chrono::steady_clock::now();
+		measurement.seconds = std::min(measurement.seconds, std::chrono::duration<double>(end - start).count());
+	}
+	return measurement;
+}
+
+void Report(const Corpus& corpus, const char* stage, Measurement measurement) {
+	double count = static_cast<double>(corpus.expressions.size());
+	std::cout << corpus.name << '\t' << stage << '\t' << corpus.expressions.size() << '\t' << corpus.bytes << '\t'
+			  << measurement.seconds * 1e9 / count << '\t' << corpus.bytes / measurement.seconds / 1e6 << '\t'
+			  << measurement.allocations / count << '\n';
+}
+
+// Lexers and parsers are kept alive between stages so each stage only
+// measures its own work, the parser stage reuses the scanned tokens and the
+// evaluation stage reuses the parsed trees
+bool RunCorpus(const Corpus& corpus, const SymbolTable& symbols, const float* slots, int repetitions) {
+	size_t count = corpus.expressions.size();
+
+	Measurement scan = Measure(corpus, repetitions, [&](size_t i) {
+		Lexer<> lexer(corpus.expressions[i]);
+		lexer.Scan();
+	});
+
+	std::vector<std::unique_ptr<Lexer<>>> lexers;
+	for (const std::string& expression : corpus.expressions) {
+		lexers.emplace_back(new Lexer<>(expression));
+		if (Error error = lexers.back()->Scan()) {
+			std::cerr << corpus.name << ": " << error << "\n";
+			return false;
+		}
+	}
+
+	Measurement parse = Measure(corpus, repetitions, [&](size_t i) {
+		Parser<> parser(lexers[i]->GetTokens(), corpus.expressions[i], symbols);
+		parser.Parse();
+	});
+
+	std::vector<std::unique_ptr<Parser<>>> parsers;
+	for (size_t i = 0; i < count; i++) {
+		parsers.emplace_back(new Parser<>(lexers[i]->GetTokens(), corpus.expressions[i], symbols));
+		if (Error error = parsers.back()->Parse()) {
+			std::cerr << corpus.name << ": " << error << "\n";
+			return false;
+		}
+	}
+
+	float checksum = 0;
+	Measurement evaluate = Measure(corpus, repetitions, [&](size_t i) { checksum += parsers[i]->GetAST()->Evaluate(slots); });
+
+	// The calculator is warmed up first, so its allocations are counted once its
+	// arena, buffers and cache entries are in place. The cache is smaller than
+	// most corpora, so this also measures misses that recycle entries
+	Calculator<> calculator;
+	for (size_t i = 0; i < VARIABLE_COUNT; i++) {
+		calculator.SetVariable(VARIABLES[i], slots[i]);
+	}
+	for (const std::string& expression : corpus.expressions) {
+		float result;
+		calculator.Evaluate(expression, result);
+	}
+	Measurement end_to_end = Measure(corpus, repetitions, [&](size_t i) {
+		float result;
+		calculator.Evaluate(corpus.expressions[i], result);
+		checksum += result;
+	});
+
+	Report(corpus, "scan", scan);
+	Report(corpus, "parse", parse);
+	Report(corpus, "evaluate", evaluate);
+	Report(corpus, "calculator", end_to_end);
+	// Keeps the evaluations from being optimised away
+	sink = checksum;
+	return true;
+}
+
+int main() {
+	const int repetitions = 5;
+	std::mt19937 rng(42);
+
+	std::vector<Corpus> corpora;
+	corpora.push_back(GenerateCorpus("short", 100000, [&]() { return GenerateShort(rng); }));
+	corpora.push_back(GenerateCorpus("nested", 2000, [&]() { return GenerateNested(rng, 64); }));
+	corpora.push_back(GenerateCorpus("chain", 1000, [&]() { return GenerateChain(rng, 256); }));
+	corpora.push_back(GenerateCorpus("literals", 10000, [&]() { return GenerateLiterals(rng, 32); }));
+	corpora.push_back(GenerateCorpus("repeated", 10000, [&]() { return GenerateRepeated(rng, 16); }));
+
+	SymbolTable symbols;
+	float slots[VARIABLE_COUNT];
+	for (size_t i = 0; i < VARIABLE_COUNT; i++) {
+		symbols.Declare(VARIABLES[i]);
+		slots[i] = 1.5f + i;
+	}
+
+	std::cout << "corpus\tstage\texpressions\tbytes\tns_per_expression\tmb_per_second\tallocations_per_expression\n";
+	for (const Corpus& corpus : corpora) {
+		if (!RunCorpus(corpus, symbols, slots, repetitions)) {
+			return 1;
+		}
+	}
+	return 0;
+}
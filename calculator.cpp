@@ -1,382 +1,1382 @@
-#include <algorithm>
+#include "calculator.h"
+
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <functional>
 #include <iostream>
-#include <locale>
+#include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
-#include <memory>
 
-class Error {
-public:
-	enum class Type { NO_ERROR, INVALID_CHAR, INVALID_TOKEN, END_OF_STREAM };
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum class Precision { FLOAT, DOUBLE, LONG_DOUBLE };
+
+struct Options {
+	bool debug = false;         // Print the compiled program and evaluate by walking the AST
+	bool batch = false;         // No banner or prompt, output is buffered until the end
+	bool cache_stats = false;   // Print cache hits and misses to stderr on exit
+	StatsFormat stats = StatsFormat::NONE; // Print stage timings and histograms to stderr on exit
+	const char* file = nullptr; // Read expressions from this file instead of stdin
+	size_t threads = 1;         // Worker threads used in batch mode, event loops in server mode
+	const char* serve = nullptr; // Listen on this [address:]port and evaluate the lines sent by every connection
+	const char* emit = nullptr; // Compile the input into a ProgramImage in this file instead of evaluating it
+	const char* load = nullptr; // Run the expressions of this ProgramImage without parsing them
+	Precision precision = Precision::FLOAT;
+	CalculatorOptions calculator; // Settings of the calculator on every thread
+};
 
-	Error(Error::Type type, size_t location, std::string_view source) : type(type), location(location), source(source) {
+// Scans the whole line up front and prints every intermediate stage
+template <typename Number>
+void ProcessDebugInput(std::string_view input, Calculator<Number>& calculator, std::ostream& out) {
+	Stats& stats = calculator.GetStats();
+	stats.AddLine(input.size());
+	uint64_t time = stats.Start();
+	Lexer<Number> lexer(input);
+	Error error = lexer.Scan();
+	time = stats.Record(Stats::SCAN, time);
+
+	if (error) {
+		stats.AddError();
+		out << error << '\n';
+		return;
 	}
 
-	operator bool() {
-		return type != Type::NO_ERROR;
+	const TokenBuffer<Number>& tokens = lexer.GetTokens();
+	out << "Scanned " << tokens.GetSize() << " tokens (" << tokens.GetMemoryUsage() << " bytes)\n";
+	time = stats.Start();
+	Parser<Number> parser(tokens, input, calculator.GetSymbols(), calculator.GetOptions().max_depth);
+	error = parser.Parse();
+	time = stats.Record(Stats::PARSE, time);
+
+	if (error) {
+		stats.AddError();
+		out << error << '\n';
+		return;
 	}
 
-	friend std::ostream& operator<<(std::ostream& out, Error error) {
-		if (error.type == Type::INVALID_CHAR) {
-			out << "Error: Unexpected Character: '" << error.source[error.location] << "'\n";
-		} else if (error.type == Type::INVALID_TOKEN) {
-			out << "Error: Unexpected Token\n";
-		} else if (error.type == Type::END_OF_STREAM) {
-			out << "Error: Unexpected End Of Stream\n";
-		}
+	stats.AddExpression(parser.GetAST());
+	time = stats.Start();
+	size_t removed = parser.Optimize();
+	const Expression<Number>* ast = parser.GetAST();
+	time = stats.Record(Stats::OPTIMIZE, time);
+	Program<Number> program;
+	ast->Compile(program);
+	time = stats.Record(Stats::COMPILE, time);
+
+	out << "Optimizer removed " << removed << " nodes\n";
+	out << program;
+	time = stats.Start();
+	Number result = ast->Evaluate(calculator.GetSlots());
+	time = stats.Record(Stats::EXECUTE, time);
+	out << result << '\n';
+	stats.Record(Stats::WRITE, time);
+}
 
-		out << "    " << error.source << "\n";
-		out << std::string(error.location + 4, ' ') << "^---- Here";
+// The debug output needs the AST, so it always goes through the parser rather
+// than the calculator's cache. Definitions are always left to the calculator
+template <typename Number>
+void ProcessInput(std::string_view input, const Options& options, Calculator<Number>& calculator, std::ostream& out) {
+	out.precision(NumberTraits<Number>::PRECISION);
+	if (options.debug && !calculator.IsDefinition(input)) {
+		ProcessDebugInput(input, calculator, out);
+		return;
+	}
 
-		return out;
+	Number result;
+	Error error = calculator.Evaluate(input, result);
+	Stats& stats = calculator.GetStats();
+	uint64_t time = stats.Start();
+	if (error) {
+		out << error << '\n';
+	} else {
+		out << result << '\n';
 	}
+	stats.Record(Stats::WRITE, time);
+}
 
-	Type type;
-	size_t location;
-	std::string_view source;
-};
+template <typename Number>
+void PrintCacheStats(const Options& options, const Calculator<Number>& calculator) {
+	const ProgramCache<Number>& cache = calculator.GetCache();
+	if (options.cache_stats) {
+		std::cerr << "cache: " << cache.GetHits() << " hits, " << cache.GetMisses() << " misses, " << cache.GetJitCompiled() << " jit compiled\n";
+	}
+	if (options.stats != StatsFormat::NONE) {
+		calculator.GetStats().Print(std::cerr, options.stats);
+	}
+}
 
-class Token {
+// Reads a file descriptor in large blocks and splits it into lines
+class LineReader {
 public:
-	enum class Type { ADD, SUB, MUL, DIV, LITERAL, RIGHT_PAREN, LEFT_PAREN };
-	Token(Type type) : token_type(type) {
+	LineReader(int fd, size_t block_size = 1 << 20) : fd(fd), buffer(block_size), begin(0), end(0), eof(false) {
 	}
 
-	Token(float value) : token_type(Type::LITERAL), literal_value(value) {
+	bool Next(std::string& line) {
+		line.clear();
+		while (true) {
+			const char* data = buffer.data();
+			const char* newline = static_cast<const char*>(std::memchr(data + begin, '\n', end - begin));
+			if (newline != nullptr) {
+				size_t length = newline - (data + begin);
+				line.append(data + begin, length);
+				begin += length + 1;
+				return true;
+			}
+
+			line.append(data + begin, end - begin);
+			begin = end = 0;
+			if (eof || !Fill()) {
+				// The last line may not be terminated by a newline
+				return !line.empty();
+			}
+		}
 	}
 
-	Type token_type;
-	float literal_value;
+private:
+	int fd;
+	std::vector<char> buffer;
+	size_t begin;
+	size_t end;
+	bool eof;
+
+private:
+	bool Fill() {
+		ssize_t count;
+		do {
+			count = read(fd, buffer.data(), buffer.size());
+		} while (count < 0 && errno == EINTR);
+
+		if (count <= 0) {
+			eof = true;
+			return false;
+		}
+		end = count;
+		return true;
+	}
 };
 
-class Lexer {
+// Stream buffer that writes to a file descriptor only when its (large) buffer is
+// full or when explicitly flushed
+class BatchWriter : public std::streambuf {
 public:
-	Lexer(const std::string& source) : position(0), tokens(), source(source) {
+	BatchWriter(int fd, size_t buffer_size = 1 << 20) : fd(fd), buffer(buffer_size) {
+		setp(buffer.data(), buffer.data() + buffer.size());
 	}
 
-	Error Scan() {
-		while (position < source.length()) {
-			if (IsWhiteSpace(source[position])) {
-				position++;
-				continue;
-			}
-			switch (source[position]) {
-			case '+':
-				tokens.emplace_back(Token::Type::ADD);
-				token_positions.push_back(position);
-				position++;
-				break;
-			case '-':
-				tokens.emplace_back(Token::Type::SUB);
-				token_positions.push_back(position);
-				position++;
-				break;
-			case '*':
-				tokens.emplace_back(Token::Type::MUL);
-				token_positions.push_back(position);
-				position++;
-				break;
-			case '/':
-				tokens.emplace_back(Token::Type::DIV);
-				token_positions.push_back(position);
-				position++;
-				break;
-			case '(':
-				tokens.emplace_back(Token::Type::LEFT_PAREN);
-				token_positions.push_back(position);
-				position++;
-				break;
-			case ')':
-				tokens.emplace_back(Token::Type::RIGHT_PAREN);
-				token_positions.push_back(position);
-				position++;
-				break;
-			default:
-				token_positions.push_back(position);
-				auto [value, success] = GetLiteral();
-				if (!success) {
-					return Error(Error::Type::INVALID_CHAR, position, source);
+	~BatchWriter() {
+		sync();
+	}
+
+protected:
+	int_type overflow(int_type ch) override {
+		if (sync() != 0) {
+			return traits_type::eof();
+		}
+		if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(ch);
+			pbump(1);
+		}
+		return traits_type::not_eof(ch);
+	}
+
+	int sync() override {
+		const char* data = pbase();
+		size_t size = pptr() - pbase();
+		while (size > 0) {
+			ssize_t count = write(fd, data, size);
+			if (count < 0) {
+				if (errno == EINTR) {
+					continue;
 				}
-				tokens.emplace_back(value);
-				break;
+				return -1;
 			}
+			data += count;
+			size -= count;
 		}
-		return Error(Error::Type::NO_ERROR, 0, source);
+		setp(buffer.data(), buffer.data() + buffer.size());
+		return 0;
+	}
+
+private:
+	int fd;
+	std::vector<char> buffer;
+};
+
+void PrintInfo() {
+	std::cout << "Basic CLI calculator by Jun Lim https://github.com/junnys6018" << std::endl;
+	std::cout << "Type 'exit' to exit\n";
+}
+
+std::string_view Trim(std::string_view s) {
+	// Trim from the left
+	while (!s.empty() && std::isspace(static_cast<unsigned char>(s.front()))) {
+		s.remove_prefix(1);
 	}
 
-	const std::vector<Token>& GetTokens() {
-		return tokens;
+	// Trim from the right
+	while (!s.empty() && std::isspace(static_cast<unsigned char>(s.back()))) {
+		s.remove_suffix(1);
 	}
+	return s;
+}
 
-	const std::vector<size_t>& GetPositions() {
-		return token_positions;
+template <typename Number>
+int RunInteractive(const Options& options) {
+	PrintInfo();
+	Calculator<Number> calculator(options.calculator);
+	std::string input;
+
+	std::cout << ">>> " << std::flush;
+	uint64_t time = calculator.GetStats().Start();
+	while (std::getline(std::cin, input)) {
+		calculator.GetStats().Record(Stats::READ, time);
+		std::string_view line = Trim(input);
+
+		if (line == "exit") {
+			break;
+		} else if (line != "") {
+			ProcessInput(line, options, calculator, std::cout);
+		}
+		std::cout << ">>> " << std::flush;
+		time = calculator.GetStats().Start();
 	}
 
-private:
-	size_t position;
-	std::vector<Token> tokens;
-	std::vector<size_t> token_positions;
-	const std::string& source;
+	PrintCacheStats(options, calculator);
+	return 0;
+}
 
-private:
-	bool IsDigit(char ch) {
-		return ch >= '0' && ch <= '9';
+// Read only mapping of a whole regular file
+class MappedFile {
+public:
+	MappedFile() : data(nullptr), size(0) {
 	}
 
-	bool IsWhiteSpace(char ch) {
-		return std::isspace(ch);
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+		if (data != nullptr) {
+			munmap(data, size);
+		}
 	}
 
-	std::pair<float, bool> GetLiteral() {
-		if (!IsDigit(source[position])) { // ".234" is considered an error
-			return {0, false};
+	// Fails for pipes, terminals and other descriptors that cannot be mapped
+	bool Map(int fd) {
+		struct stat info;
+		if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+			return false;
 		}
-		size_t start = position;
-		bool has_decimal_point = false;
 
-		while (IsDigit(source[position]) || (!has_decimal_point && source[position] == '.')) {
-			if (source[position] == '.') {
-				has_decimal_point = true;
-			}
-			position++;
+		size = info.st_size;
+		if (size == 0) {
+			// mmap() rejects empty mappings, an empty file simply has no lines
+			return true;
 		}
 
-		// I believe string::substr() makes a copy, probs not a good idea here as
-		// we only want to parse a float from a string
-		return {std::stof(source.substr(start, position - start)), true};
+		void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED) {
+			size = 0;
+			return false;
+		}
+		madvise(mapping, size, MADV_SEQUENTIAL);
+		data = static_cast<char*>(mapping);
+		return true;
 	}
-};
 
-class Expression {
-public:
-	virtual float Evaluate() const = 0;
-	virtual ~Expression() {
+	std::string_view GetContents() const {
+		return std::string_view(data, size);
 	}
+
+private:
+	char* data;
+	size_t size;
 };
 
-class LiteralExpression : public Expression {
+// Returns false once the input asks to exit
+template <typename Number>
+bool ProcessLine(std::string_view input, const Options& options, Calculator<Number>& calculator, std::ostream& out) {
+	std::string_view line = Trim(input);
+
+	if (line == "exit") {
+		return false;
+	} else if (line != "") {
+		ProcessInput(line, options, calculator, out);
+	}
+	return true;
+}
+
+// Returns false if the lines contained an exit command
+template <typename Number>
+bool ProcessLines(std::string_view contents, const Options& options, Calculator<Number>& calculator, std::ostream& out) {
+	while (!contents.empty()) {
+		size_t newline = contents.find('\n');
+		std::string_view line = contents.substr(0, newline);
+		if (!ProcessLine(line, options, calculator, out)) {
+			return false;
+		}
+		if (newline == std::string_view::npos) {
+			break;
+		}
+		contents.remove_prefix(newline + 1);
+	}
+	return true;
+}
+
+// Splits the contents into roughly equal chunks that each end on a line boundary
+std::vector<std::string_view> SplitChunks(std::string_view contents, size_t count) {
+	std::vector<std::string_view> chunks;
+	size_t target = contents.size() / count + 1;
+	while (!contents.empty()) {
+		size_t end = contents.find('\n', std::min(target, contents.size() - 1));
+		end = end == std::string_view::npos ? contents.size() : end + 1;
+		chunks.push_back(contents.substr(0, end));
+		contents.remove_prefix(end);
+	}
+	return chunks;
+}
+
+// Definitions make later lines depend on earlier ones, so input that has any is
+// evaluated on one thread
+template <typename Number>
+bool HasDefinitions(std::string_view contents, const Calculator<Number>& calculator) {
+	for (size_t match = contents.find("let"); match != std::string_view::npos; match = contents.find("let", match + 1)) {
+		size_t start = contents.rfind('\n', match);
+		start = start == std::string_view::npos ? 0 : start + 1;
+		if (calculator.IsDefinition(contents.substr(start, match + 4 - start))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Lines are independent so chunks of them are evaluated concurrently, each into
+// its own output buffer. The buffers are written out in input order, stopping
+// after the first chunk that asked to exit. Every worker has its own
+// calculator, their counters are merged into the given one afterwards
+template <typename Number>
+void ProcessLinesParallel(std::string_view contents, const Options& options, Calculator<Number>& calculator, std::ostream& out) {
+	// More chunks than threads so a slow chunk does not hold up the others
+	std::vector<std::string_view> chunks = SplitChunks(contents, options.threads * 4);
+	std::vector<std::string> results(chunks.size());
+	std::vector<char> exited(chunks.size(), false);
+	std::atomic<size_t> next_chunk{0};
+
+	auto worker = [&](Calculator<Number>& worker_calculator) {
+		size_t chunk;
+		while ((chunk = next_chunk.fetch_add(1, std::memory_order_relaxed)) < chunks.size()) {
+			std::ostringstream buffer;
+			exited[chunk] = !ProcessLines(chunks[chunk], options, worker_calculator, buffer);
+			results[chunk] = buffer.str();
+		}
+	};
+
+	std::vector<std::unique_ptr<Calculator<Number>>> calculators;
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < options.threads; i++) {
+		calculators.emplace_back(new Calculator<Number>(options.calculator));
+		threads.emplace_back(worker, std::ref(*calculators.back()));
+	}
+	worker(calculator);
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+		calculator.MergeCounters(*calculators[i]);
+	}
+
+	for (size_t i = 0; i < chunks.size(); i++) {
+		out << results[i];
+		if (exited[i]) {
+			break;
+		}
+	}
+}
+
+// Stream buffer that appends to a string, pointed at the output of whichever
+// connection or block of lines is being evaluated
+class StringWriter : public std::streambuf {
 public:
-	LiteralExpression(float value) : value(value) {
+	StringWriter() : target(nullptr) {
 	}
-	float Evaluate() const override {
-		return value;
+
+	void SetTarget(std::string* target) {
+		this->target = target;
+	}
+
+protected:
+	int_type overflow(int_type ch) override {
+		if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+			target->push_back(traits_type::to_char_type(ch));
+		}
+		return traits_type::not_eof(ch);
 	}
 
-	float value;
+	std::streamsize xsputn(const char* data, std::streamsize count) override {
+		target->append(data, count);
+		return count;
+	}
+
+private:
+	std::string* target;
 };
 
-class BinaryExpression : public Expression {
+// Waits for another thread without a lock, spinning briefly before giving up
+// the core and then sleeping for longer and longer
+class Backoff {
 public:
-	BinaryExpression(Expression* lhs, Expression* rhs) : lhs(lhs), rhs(rhs) {
+	void Wait() {
+		if (step < SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+			_mm_pause();
+#endif
+		} else if (step < SPINS + YIELDS) {
+			std::this_thread::yield();
+		} else {
+			std::this_thread::sleep_for(std::chrono::microseconds(sleep));
+			sleep = std::min(sleep * 2, MAX_SLEEP);
+		}
+		step++;
 	}
 
-	std::unique_ptr<Expression> lhs;
-	std::unique_ptr<Expression> rhs;
+private:
+	static constexpr unsigned SPINS = 64;
+	static constexpr unsigned YIELDS = 16;
+	static constexpr unsigned MAX_SLEEP = 1000;
+
+	unsigned step = 0;
+	unsigned sleep = 10;
 };
 
-class AddExpression : public BinaryExpression {
+// Bounded queue for any number of producers and consumers after Dmitry Vyukov's
+// design. Every cell has a sequence number that says whether it is waiting for
+// a producer or a consumer of a given lap, so each side only needs a compare
+// and swap on its own index
+template <typename T>
+class BoundedQueue {
 public:
-	AddExpression(Expression* lhs, Expression* rhs) : BinaryExpression(lhs, rhs) {
+	// The capacity is rounded up to a power of two
+	BoundedQueue(size_t capacity) : cells(RoundUp(capacity)), mask(cells.size() - 1) {
+		for (size_t i = 0; i < cells.size(); i++) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
 	}
 
-	float Evaluate() const override {
-		return lhs->Evaluate() + rhs->Evaluate();
+	// Returns false if the queue is full
+	bool TryPush(T value) {
+		size_t position = tail.load(std::memory_order_relaxed);
+		while (true) {
+			Cell& cell = cells[position & mask];
+			size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+			if (difference == 0) {
+				if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					cell.value = value;
+					cell.sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (difference < 0) {
+				return false;
+			} else {
+				position = tail.load(std::memory_order_relaxed);
+			}
+		}
 	}
-};
 
-class SubtractExpression : public BinaryExpression {
-public:
-	SubtractExpression(Expression* lhs, Expression* rhs) : BinaryExpression(lhs, rhs) {
+	// Returns false if the queue is empty
+	bool TryPop(T& value) {
+		size_t position = head.load(std::memory_order_relaxed);
+		while (true) {
+			Cell& cell = cells[position & mask];
+			size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+			if (difference == 0) {
+				if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					value = cell.value;
+					cell.sequence.store(position + mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (difference < 0) {
+				return false;
+			} else {
+				position = head.load(std::memory_order_relaxed);
+			}
+		}
 	}
 
-	float Evaluate() const override {
-		return lhs->Evaluate() - rhs->Evaluate();
+	void Push(T value) {
+		Backoff backoff;
+		while (!TryPush(value)) {
+			backoff.Wait();
+		}
 	}
-};
 
-class MultiplyExpression : public BinaryExpression {
-public:
-	MultiplyExpression(Expression* lhs, Expression* rhs) : BinaryExpression(lhs, rhs) {
+	T Pop() {
+		T value;
+		Backoff backoff;
+		while (!TryPop(value)) {
+			backoff.Wait();
+		}
+		return value;
 	}
 
-	float Evaluate() const override {
-		return lhs->Evaluate() * rhs->Evaluate();
+private:
+	// Cells and indices get cache lines of their own, so producers and consumers
+	// do not invalidate each other's
+	struct alignas(64) Cell {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::vector<Cell> cells;
+	size_t mask;
+	alignas(64) std::atomic<size_t> tail{0};
+	alignas(64) std::atomic<size_t> head{0};
+
+private:
+	static size_t RoundUp(size_t capacity) {
+		size_t size = 1;
+		while (size < capacity) {
+			size *= 2;
+		}
+		return size;
 	}
 };
 
-class DivideExpression : public BinaryExpression {
+// Complete lines of a stream, evaluated as one unit by a pipeline worker
+struct Block {
+	size_t sequence = 0;
+	std::string input;
+	std::string output;
+	bool exited = false; // The lines contained an exit command
+	bool last = false;   // Ends the stream, its input is not evaluated by workers
+};
+
+// Reads a stream into blocks of complete lines. A block is handed out as soon
+// as a read ends on a line, so a slow stream is not held back waiting for a
+// full block, and a fast one gives blocks as large as a read. Reading stops
+// early once the wake descriptor is signalled
+class BlockReader {
 public:
-	DivideExpression(Expression* lhs, Expression* rhs) : BinaryExpression(lhs, rhs) {
+	static constexpr size_t READ_SIZE = 1 << 16;
+
+	BlockReader(int fd, int wake) : fd(fd), wake(wake), eof(false) {
+	}
+
+	// Replaces text with the next lines, returns false at the end of the stream.
+	// The last line may not be terminated by a newline
+	bool Next(std::string& text) {
+		text.swap(carry);
+		carry.clear();
+		while (!eof) {
+			size_t scanned = text.size();
+			if (!Fill(text)) {
+				eof = true;
+				break;
+			}
+			size_t newline = text.rfind('\n');
+			if (newline != std::string::npos && newline >= scanned) {
+				carry.assign(text, newline + 1, std::string::npos);
+				text.resize(newline + 1);
+				return true;
+			}
+		}
+		return !stopped && !text.empty();
 	}
 
-	float Evaluate() const override {
-		return lhs->Evaluate() / rhs->Evaluate();
+	// The errno of a failed read, which ends the stream early
+	int GetError() const {
+		return error;
+	}
+
+private:
+	int fd;
+	int wake;
+	bool eof;
+	bool stopped = false;
+	int error = 0;
+	std::string carry;
+
+private:
+	// Appends one read to text, returns false at the end of the stream or once
+	// woken
+	bool Fill(std::string& text) {
+		pollfd descriptors[2] = {{fd, POLLIN, 0}, {wake, POLLIN, 0}};
+		while (poll(descriptors, 2, -1) < 0) {
+			if (errno != EINTR) {
+				error = errno;
+				return false;
+			}
+		}
+		if (descriptors[1].revents != 0) {
+			stopped = true;
+			return false;
+		}
+
+		size_t size = text.size();
+		text.resize(size + READ_SIZE);
+		ssize_t count;
+		do {
+			count = read(fd, &text[size], READ_SIZE);
+		} while (count < 0 && errno == EINTR);
+		if (count < 0) {
+			error = errno;
+		}
+		text.resize(size + std::max<ssize_t>(count, 0));
+		return count > 0;
 	}
 };
 
-class Parser {
-public:
-	Parser(const std::vector<Token>& tokens, const std::vector<size_t>& token_positions, const std::string& source)
-		: position(0), tokens(tokens), token_positions(token_positions), source(source) {
+// Streams input that cannot be mapped through a bounded pipeline. This thread
+// reads blocks of lines, every worker thread evaluates blocks with a calculator
+// of its own and a writer thread writes their outputs in input order. The
+// stages pass blocks through lock free queues and only BLOCKS_PER_THREAD
+// blocks per worker exist, so memory stays constant however long the stream
+// is. Lines after the first block with a definition may depend on it, so that
+// block and the rest of the stream are evaluated on this thread once the
+// blocks before it are written
+template <typename Number>
+void ProcessStream(int fd, const Options& options, Calculator<Number>& calculator, std::ostream& out) {
+	constexpr size_t BLOCKS_PER_THREAD = 4;
+	size_t block_count = options.threads * BLOCKS_PER_THREAD;
+	std::vector<Block> blocks(block_count);
+	BoundedQueue<Block*> free_blocks(block_count);
+	BoundedQueue<Block*> work(block_count + options.threads);
+	BoundedQueue<Block*> done(block_count);
+	for (Block& block : blocks) {
+		free_blocks.Push(&block);
 	}
+	// Signalled by the writer once a block asked to exit, so the reader stops
+	int wake = eventfd(0, EFD_CLOEXEC);
+
+	// A null block stops a worker
+	auto worker = [&](Calculator<Number>& worker_calculator) {
+		StringWriter buffer;
+		std::ostream stream(&buffer);
+		while (Block* block = work.Pop()) {
+			if (!block->last) {
+				block->output.clear();
+				buffer.SetTarget(&block->output);
+				block->exited = !ProcessLines(block->input, options, worker_calculator, stream);
+			}
+			done.Push(block);
+		}
+	};
+
+	// Blocks finish out of order, at most block_count of them are in flight so
+	// each has a slot of its own until the ones before it are written
+	bool exited = false;
+	auto writer = [&]() {
+		std::vector<Block*> pending(block_count, nullptr);
+		size_t next = 0;
+		while (true) {
+			// Results are flushed whenever the writer catches up, so a slow stream
+			// sees them as its lines are evaluated
+			Block* block;
+			if (!done.TryPop(block)) {
+				out.flush();
+				block = done.Pop();
+			}
+			pending[block->sequence % block_count] = block;
+			while (Block* ready = pending[next % block_count]) {
+				pending[next++ % block_count] = nullptr;
+				if (ready->last) {
+					out.flush();
+					return;
+				}
+				if (!exited) {
+					out << ready->output;
+					if (ready->exited) {
+						exited = true;
+						uint64_t one = 1;
+						write(wake, &one, sizeof(one));
+					}
+				}
+				free_blocks.Push(ready);
+			}
+		}
+	};
 
-	Error Parse() {
-		try {
-			expr = std::shared_ptr<Expression>(Term());
-		} catch (int) {
-			if (IsAtEnd()) {
-				return Error(Error::Type::END_OF_STREAM, source.size(), source);
+	std::vector<std::unique_ptr<Calculator<Number>>> calculators;
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < options.threads; i++) {
+		calculators.emplace_back(new Calculator<Number>(options.calculator));
+		threads.emplace_back(worker, std::ref(*calculators.back()));
+	}
+	std::thread writer_thread(writer);
+
+	BlockReader reader(fd, wake);
+	size_t sequence = 0;
+	bool sequential = false;
+	Block* block;
+	while (true) {
+		block = free_blocks.Pop();
+		uint64_t time = calculator.GetStats().Start();
+		bool read = reader.Next(block->input);
+		calculator.GetStats().Record(Stats::READ, time);
+		block->sequence = sequence++;
+		if (!read) {
+			break;
+		}
+		if (HasDefinitions(block->input, calculator)) {
+			sequential = true;
+			break;
+		}
+		work.Push(block);
+	}
+	// The last block also keeps the lines that are left to this thread
+	block->last = true;
+	work.Push(block);
+	for (size_t i = 0; i < threads.size(); i++) {
+		work.Push(nullptr);
+	}
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+		calculator.MergeCounters(*calculators[i]);
+	}
+	writer_thread.join();
+
+	if (sequential && !exited && ProcessLines(block->input, options, calculator, out)) {
+		while (true) {
+			uint64_t time = calculator.GetStats().Start();
+			bool read = reader.Next(block->input);
+			calculator.GetStats().Record(Stats::READ, time);
+			if (!read || !ProcessLines(block->input, options, calculator, out)) {
+				break;
 			}
+		}
+	}
+	close(wake);
+	if (reader.GetError() != 0) {
+		std::cerr << "Could not read input: " << std::strerror(reader.GetError()) << "\n";
+	}
+}
 
-			return Error(Error::Type::INVALID_TOKEN, token_positions[position], source);
+template <typename Number>
+int RunBatch(const Options& options) {
+	int fd = STDIN_FILENO;
+	if (options.file != nullptr) {
+		fd = open(options.file, O_RDONLY);
+		if (fd < 0) {
+			std::cerr << "Could not open " << options.file << ": " << std::strerror(errno) << "\n";
+			return 1;
 		}
+	}
 
-		if (position != tokens.size()) {
-			return Error(Error::Type::INVALID_TOKEN, token_positions[position], source);
+	BatchWriter writer(STDOUT_FILENO);
+	std::ostream out(&writer);
+	Calculator<Number> calculator(options.calculator);
+
+	// Regular files (including redirected stdin) are mapped and lexed in place,
+	// anything else is read block by block, and streamed through a pipeline when
+	// running on several threads
+	MappedFile file;
+	uint64_t time = calculator.GetStats().Start();
+	bool mapped = file.Map(fd);
+	calculator.GetStats().Record(Stats::READ, time);
+	if (mapped) {
+		std::string_view contents = file.GetContents();
+		if (options.threads > 1 && !HasDefinitions(contents, calculator)) {
+			ProcessLinesParallel(contents, options, calculator, out);
+		} else {
+			ProcessLines(contents, options, calculator, out);
+		}
+	} else if (options.threads > 1) {
+		ProcessStream(fd, options, calculator, out);
+	} else {
+		LineReader reader(fd);
+		std::string input;
+		while (true) {
+			time = calculator.GetStats().Start();
+			bool read = reader.Next(input);
+			calculator.GetStats().Record(Stats::READ, time);
+			if (!read || !ProcessLine(input, options, calculator, out)) {
+				break;
+			}
 		}
-		return Error(Error::Type::NO_ERROR, 0, source);
 	}
 
-	std::shared_ptr<Expression> GetAST() {
-		return expr;
+	if (fd != STDIN_FILENO) {
+		close(fd);
 	}
+	PrintCacheStats(options, calculator);
+	return 0;
+}
 
-private:
-	size_t position;
-	const std::vector<Token>& tokens;
-	const std::vector<size_t>& token_positions;
-	const std::string& source;
-	std::shared_ptr<Expression> expr;
+// Writes the whole file next to its destination and renames it over it, so a
+// process that has the old file mapped never sees it change
+bool WriteFile(const char* path, std::string_view contents) {
+	std::string temporary = std::string(path) + ".tmp";
+	int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	while (!contents.empty()) {
+		ssize_t count = write(fd, contents.data(), contents.size());
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count < 0) {
+			int error = errno;
+			close(fd);
+			unlink(temporary.c_str());
+			errno = error;
+			return false;
+		}
+		contents.remove_prefix(count);
+	}
+	if (close(fd) != 0 || rename(temporary.c_str(), path) != 0) {
+		int error = errno;
+		unlink(temporary.c_str());
+		errno = error;
+		return false;
+	}
+	return true;
+}
 
-private:
-	template <typename... Args>
-	bool Match(Token::Type first, Args... args) {
-		return Check(first) || Match(args...);
+// Compiles every expression of the input once, in order, and writes them to
+// options.emit. Definitions are evaluated so later lines can read the names
+// they declare, and the last definition of each name is stored with it. Errors
+// are printed as in batch mode
+template <typename Number>
+int RunEmit(const Options& options) {
+	int fd = STDIN_FILENO;
+	if (options.file != nullptr) {
+		fd = open(options.file, O_RDONLY);
+		if (fd < 0) {
+			std::cerr << "Could not open " << options.file << ": " << std::strerror(errno) << "\n";
+			return 1;
+		}
 	}
 
-	bool Match(Token::Type first) {
-		return Check(first);
+	BatchWriter writer(STDOUT_FILENO);
+	std::ostream out(&writer);
+	Calculator<Number> calculator(options.calculator);
+	std::vector<std::string> keys;
+	std::vector<Program<Number>> programs;
+	std::unordered_set<std::string> emitted;
+	LineReader reader(fd);
+	std::string input;
+	std::string key;
+	while (reader.Next(input)) {
+		std::string_view line = Trim(input);
+		if (line == "exit") {
+			break;
+		} else if (line == "") {
+			continue;
+		}
+
+		Number result;
+		Program<Number> program;
+		Error error = calculator.IsDefinition(line) ? calculator.Evaluate(line, result) : calculator.Compile(line, program);
+		if (error) {
+			out << error << '\n';
+		} else if (!program.GetInstructions().empty()) {
+			ProgramCache<Number>::Normalise(line, key);
+			if (emitted.insert(key).second) {
+				keys.push_back(key);
+				programs.push_back(std::move(program));
+			}
+		}
 	}
 
-	bool Check(Token::Type type) {
-		if (IsAtEnd())
-			return false;
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+	std::vector<const Program<Number>*> definitions;
+	for (uint32_t slot = 0; slot < calculator.GetSymbols().GetSize(); slot++) {
+		definitions.push_back(calculator.GetDefinition(slot));
+	}
+	std::string image;
+	ProgramImage<Number>::Write(calculator.GetSymbols(), definitions, keys, programs, image);
+	if (!WriteFile(options.emit, image)) {
+		std::cerr << "Could not write " << options.emit << ": " << std::strerror(errno) << "\n";
+		return 1;
+	}
+	PrintCacheStats(options, calculator);
+	return 0;
+}
+
+// Opens a non blocking listening socket on [address:]port, the address defaults
+// to the loopback interface. Every event loop opens its own socket on the same
+// port and the kernel spreads new connections across them
+int Listen(std::string_view address) {
+	std::string host = "127.0.0.1";
+	std::string_view port = address;
+	size_t colon = address.rfind(':');
+	if (colon != std::string_view::npos) {
+		host = std::string(address.substr(0, colon));
+		port = address.substr(colon + 1);
+	}
+
+	sockaddr_in socket_address;
+	std::memset(&socket_address, 0, sizeof(socket_address));
+	socket_address.sin_family = AF_INET;
+	uint16_t port_number = 0;
+	auto [end, error] = std::from_chars(port.data(), port.data() + port.size(), port_number);
+	if (port.empty() || error != std::errc() || end != port.data() + port.size() ||
+		inet_pton(AF_INET, host.c_str(), &socket_address.sin_addr) != 1) {
+		std::cerr << "Invalid address: " << address << "\n";
+		return -1;
+	}
+	socket_address.sin_port = htons(port_number);
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int enable = 1;
+	if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0 ||
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0 ||
+		bind(fd, reinterpret_cast<sockaddr*>(&socket_address), sizeof(socket_address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		std::cerr << "Could not listen on " << address << ": " << std::strerror(errno) << "\n";
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
 
-		return tokens[position].token_type == type;
+// Every connection is a descriptor, so allow as many as the hard limit does
+void RaiseFileLimit() {
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
 	}
+}
 
-	bool IsAtEnd() {
-		return position == tokens.size();
+// One thread serving many connections with an edge triggered epoll set. Every
+// line a connection sends is evaluated like a line of batch input and the
+// results of everything that arrived in one read are sent back with one write
+template <typename Number>
+class EventLoop {
+public:
+	// Bytes read from a socket at a time
+	static constexpr size_t READ_SIZE = 1 << 16;
+	// A connection that does not read its results is not read from either once
+	// this much output is waiting
+	static constexpr size_t MAX_PENDING_OUTPUT = 1 << 20;
+	// Connections sending a longer line are closed
+	static constexpr size_t MAX_LINE_LENGTH = 1 << 20;
+	static constexpr int EVENT_BATCH_SIZE = 256;
+
+	EventLoop(const Options& options, int listener, int stop_event)
+		: options(options), calculator(options.calculator), listener(listener), stop_event(stop_event), epoll(-1),
+		  reserve(open("/dev/null", O_RDONLY | O_CLOEXEC)), buffer(READ_SIZE), out(&writer) {
 	}
 
-	void Consume(Token::Type type) {
-		if (tokens[position].token_type != type) {
-			throw 1;
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+
+	~EventLoop() {
+		for (auto& [fd, connection] : connections) {
+			close(fd);
+		}
+		if (epoll >= 0) {
+			close(epoll);
+		}
+		if (reserve >= 0) {
+			close(reserve);
 		}
-		position++;
+		close(listener);
 	}
 
-	Expression* Term() {
-		Expression* expr = Factor();
+	bool Start() {
+		epoll = epoll_create1(EPOLL_CLOEXEC);
+		return epoll >= 0 && Watch(listener, &listener, EPOLLIN) && Watch(stop_event, &stop_event, EPOLLIN);
+	}
 
-		while (Match(Token::Type::ADD, Token::Type::SUB)) {
-			Token::Type type = tokens[position].token_type;
-			position++;
-			Expression* rhs = Factor();
-			if (type == Token::Type::ADD) {
-				expr = new AddExpression{expr, rhs};
-			} else {
-				expr = new SubtractExpression{expr, rhs};
+	// Returns once the stop event is signalled
+	void Run() {
+		epoll_event events[EVENT_BATCH_SIZE];
+		while (true) {
+			int count = epoll_wait(epoll, events, EVENT_BATCH_SIZE, -1);
+			if (count < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				std::cerr << "epoll_wait failed: " << std::strerror(errno) << "\n";
+				return;
+			}
+
+			for (int i = 0; i < count; i++) {
+				void* tag = events[i].data.ptr;
+				if (tag == &stop_event) {
+					return;
+				} else if (tag == &listener) {
+					Accept();
+				} else {
+					Connection* connection = static_cast<Connection*>(tag);
+					if (!Service(*connection)) {
+						Close(*connection);
+					}
+				}
 			}
 		}
+	}
 
-		return expr;
+	Calculator<Number>& GetCalculator() {
+		return calculator;
 	}
 
-	Expression* Factor() {
-		Expression* expr = Primary();
+private:
+	struct Connection {
+		int fd;
+		bool closing = false; // Sent exit or hung up, closed once the output is sent
+		std::string input;    // Start of a line that has not been terminated yet
+		std::string output;   // Results the socket has not accepted yet
+		size_t written = 0;   // Bytes at the start of output that were already sent
+	};
+
+	const Options& options;
+	Calculator<Number> calculator;
+	int listener;
+	int stop_event;
+	int epoll;
+	int reserve; // Spare descriptor, see Accept()
+	std::unordered_map<int, std::unique_ptr<Connection>> connections;
+	std::vector<char> buffer;
+	StringWriter writer;
+	std::ostream out;
 
-		while (Match(Token::Type::MUL, Token::Type::DIV)) {
-			Token::Type type = tokens[position].token_type;
-			position++;
-			Expression* rhs = Primary();
-			if (type == Token::Type::MUL) {
-				expr = new MultiplyExpression{expr, rhs};
-			} else {
-				expr = new DivideExpression{expr, rhs};
+private:
+	bool Watch(int fd, void* tag, uint32_t events) {
+		epoll_event event;
+		event.events = events;
+		event.data.ptr = tag;
+		return epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+	}
+
+	void Accept() {
+		while (true) {
+			int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0) {
+				if (errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+				if ((errno == EMFILE || errno == ENFILE) && reserve >= 0) {
+					// Out of descriptors, the connection would stay queued and wake
+					// the loop forever. The reserve lets it be accepted and closed
+					close(reserve);
+					fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+					if (fd >= 0) {
+						close(fd);
+					}
+					reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+					if (fd < 0) {
+						return;
+					}
+					continue;
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					std::cerr << "accept failed: " << std::strerror(errno) << "\n";
+				}
+				return;
+			}
+
+			// Results are single short lines, send them without waiting for more
+			int enable = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+			std::unique_ptr<Connection>& connection = connections[fd];
+			connection.reset(new Connection());
+			connection->fd = fd;
+			if (!Watch(fd, connection.get(), EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) {
+				Close(*connection);
 			}
 		}
+	}
 
-		return expr;
+	void Close(Connection& connection) {
+		int fd = connection.fd;
+		close(fd);
+		connections.erase(fd);
 	}
 
-	Expression* Primary() {
-		if (Match(Token::Type::LITERAL)) {
-			float value = tokens[position].literal_value;
-			position++;
-			return new LiteralExpression{value};
+	// Sends as much pending output as the socket takes, returns false if the
+	// connection failed
+	bool Flush(Connection& connection) {
+		while (connection.written < connection.output.size()) {
+			ssize_t count = send(connection.fd, connection.output.data() + connection.written,
+								 connection.output.size() - connection.written, MSG_NOSIGNAL);
+			if (count < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return errno == EAGAIN || errno == EWOULDBLOCK;
+			}
+			connection.written += count;
 		}
+		connection.output.clear();
+		connection.written = 0;
+		return true;
+	}
 
-		if (Match(Token::Type::LEFT_PAREN)) {
-			position++;
-			Expression* expr = Term();
-			Consume(Token::Type::RIGHT_PAREN);
-			return expr;
+	// Evaluates every complete line in data and returns the number of bytes
+	// consumed. Stops and marks the connection as closing at an exit command
+	size_t ProcessLines(std::string_view data, Connection& connection) {
+		size_t consumed = 0;
+		while (!connection.closing) {
+			const char* newline = static_cast<const char*>(std::memchr(data.data() + consumed, '\n', data.size() - consumed));
+			if (newline == nullptr) {
+				break;
+			}
+			size_t length = newline - (data.data() + consumed);
+			connection.closing = !ProcessLine(data.substr(consumed, length), options, calculator, out);
+			consumed += length + 1;
 		}
+		return consumed;
+	}
+
+	// Called on every event, reads until the socket is drained or too much
+	// output is waiting. Returns false once the connection should be closed
+	bool Service(Connection& connection) {
+		writer.SetTarget(&connection.output);
+		while (true) {
+			if (!Flush(connection)) {
+				return false;
+			}
+			if (connection.closing) {
+				return !connection.output.empty();
+			}
+			if (connection.output.size() >= MAX_PENDING_OUTPUT) {
+				// The socket is full, the next EPOLLOUT resumes reading
+				return true;
+			}
+
+			uint64_t time = calculator.GetStats().Start();
+			ssize_t count = read(connection.fd, buffer.data(), buffer.size());
+			calculator.GetStats().Record(Stats::READ, time);
+			if (count < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return errno == EAGAIN || errno == EWOULDBLOCK;
+			}
 
-		throw 1;
+			if (count == 0) {
+				// The peer is done sending, its last line may not end in a newline
+				if (!connection.input.empty()) {
+					ProcessLine(connection.input, options, calculator, out);
+					connection.input.clear();
+				}
+				connection.closing = true;
+				continue;
+			}
+
+			// Lines that arrived whole are evaluated straight from the read buffer,
+			// only the unterminated tail is copied
+			std::string_view data(buffer.data(), count);
+			if (!connection.input.empty()) {
+				connection.input.append(data);
+				data = connection.input;
+			}
+			size_t consumed = ProcessLines(data, connection);
+			if (connection.closing) {
+				connection.input.clear();
+			} else if (data.data() == connection.input.data()) {
+				connection.input.erase(0, consumed);
+			} else {
+				connection.input.assign(data.substr(consumed));
+			}
+			if (connection.input.size() > MAX_LINE_LENGTH) {
+				return false;
+			}
+		}
 	}
 };
 
-void ProcessInput(const std ::string& input) {
-	Lexer lexer(input);
-	Error error = lexer.Scan();
-
-	if (error) {
-		std::cout << error << std::endl;
-		return;
+// Runs an event loop per thread until SIGINT or SIGTERM, then prints the merged
+// counters of every loop. Connections share the calculator of their loop, so
+// definitions are turned off rather than leak from one connection to another
+template <typename Number>
+int RunServer(Options options) {
+	options.calculator.definitions = false;
+
+	// Blocked before any thread starts so only sigwait() below receives them
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+	RaiseFileLimit();
+
+	int stop_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (stop_event < 0) {
+		std::cerr << "Could not create event: " << std::strerror(errno) << "\n";
+		return 1;
 	}
 
-	Parser parser(lexer.GetTokens(), lexer.GetPositions(), input);
-	error = parser.Parse();
+	std::vector<std::unique_ptr<EventLoop<Number>>> loops;
+	for (size_t i = 0; i < options.threads; i++) {
+		int listener = Listen(options.serve);
+		if (listener < 0) {
+			close(stop_event);
+			return 1;
+		}
+		loops.emplace_back(new EventLoop<Number>(options, listener, stop_event));
+		if (!loops.back()->Start()) {
+			std::cerr << "Could not create event loop: " << std::strerror(errno) << "\n";
+			close(stop_event);
+			return 1;
+		}
+	}
 
-	if (error) {
-		std::cout << error << std::endl;
-		return;
+	std::vector<std::thread> threads;
+	for (std::unique_ptr<EventLoop<Number>>& loop : loops) {
+		threads.emplace_back(&EventLoop<Number>::Run, loop.get());
 	}
 
-	std::cout << parser.GetAST()->Evaluate() << std::endl;
-}
+	int signal;
+	sigwait(&signals, &signal);
+	// The event stays readable, so it stops every loop
+	uint64_t one = 1;
+	if (write(stop_event, &one, sizeof(one)) < 0) {
+		std::cerr << "Could not stop event loops: " << std::strerror(errno) << "\n";
+	}
 
-void PrintInfo() {
-	std::cout << "Basic CLI calculator by Jun Lim https://github.com/junnys6018" << std::endl;
-	std::cout << "Type 'exit' to exit\n";
+	Calculator<Number>& calculator = loops[0]->GetCalculator();
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+		if (i > 0) {
+			calculator.MergeCounters(loops[i]->GetCalculator());
+		}
+	}
+	PrintCacheStats(options, calculator);
+	loops.clear();
+	close(stop_event);
+	return 0;
 }
 
-void Trim(std::string& s) {
-	// Trim from the left
-	s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch) { return !std::isspace(ch); }));
+// Maps the image of options.load and checks it once, every calculator then
+// indexes the same pages
+template <typename Number>
+bool LoadImage(Options& options, MappedFile& file) {
+	int fd = open(options.load, O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "Could not open " << options.load << ": " << std::strerror(errno) << "\n";
+		return false;
+	}
+	bool mapped = file.Map(fd);
+	close(fd);
+	if (!mapped) {
+		std::cerr << "Could not map " << options.load << "\n";
+		return false;
+	}
 
-	// Trim from the right
-	s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char ch) { return !std::isspace(ch); }).base(), s.end());
+	std::string_view contents = file.GetContents();
+	ProgramImage<Number> image;
+	if (!image.Open(contents.data(), contents.size())) {
+		std::cerr << options.load << ": " << image.GetError() << "\n";
+		return false;
+	}
+	options.calculator.image = contents;
+	return true;
 }
 
-int main() {
-	PrintInfo();
-	std::string input;
+// The number type is chosen once here, everything below is instantiated for it
+template <typename Number>
+int Run(Options options) {
+	MappedFile image;
+	if (options.load != nullptr && !LoadImage<Number>(options, image)) {
+		return 1;
+	}
+	if (options.emit != nullptr) {
+		return RunEmit<Number>(options);
+	} else if (options.serve != nullptr) {
+		return RunServer<Number>(options);
+	} else if (options.batch) {
+		return RunBatch<Number>(options);
+	}
+	return RunInteractive<Number>(options);
+}
 
-	std::cout << ">>> ";
-	while (std::getline(std::cin, input)) {
-		Trim(input);
+void PrintUsage(const char* program) {
+	std::cerr << "Usage: " << program << " [--debug] [-f file] [-j threads] [--cache-size entries] [--jit-threshold hits] [--cache-stats]\n";
+	std::cerr << "       [--precision float|double|long-double] [--stats[=json]] [--max-depth levels]\n";
+	std::cerr << "       [--serve [address:]port] [--emit file] [--load file] [--tree-threads threads]\n";
+}
 
-		if (input == "exit") {
-			return 0;
-		} else if (input == "") {
-			std::cout << ">>> ";
-			continue;
+// Benchmarks include this file directly and provide their own main()
+#ifndef CALCULATOR_NO_MAIN
+int main(int argc, char** argv) {
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		std::string_view arg = argv[i];
+		if (arg == "--debug") {
+			options.debug = true;
+		} else if (arg == "-f" && i + 1 < argc) {
+			options.file = argv[++i];
+		} else if (arg == "--cache-size" && i + 1 < argc) {
+			options.calculator.cache_size = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--max-depth" && i + 1 < argc) {
+			options.calculator.max_depth = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--tree-threads" && i + 1 < argc) {
+			options.calculator.tree_threads = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--jit-threshold" && i + 1 < argc) {
+			options.calculator.jit_threshold = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--precision" && i + 1 < argc) {
+			std::string_view precision = argv[++i];
+			if (precision == "float") {
+				options.precision = Precision::FLOAT;
+			} else if (precision == "double") {
+				options.precision = Precision::DOUBLE;
+			} else if (precision == "long-double") {
+				options.precision = Precision::LONG_DOUBLE;
+			} else {
+				std::cerr << "Unknown precision: " << precision << "\n";
+				PrintUsage(argv[0]);
+				return 1;
+			}
+		} else if (arg == "--serve" && i + 1 < argc) {
+			options.serve = argv[++i];
+		} else if (arg == "--emit" && i + 1 < argc) {
+			options.emit = argv[++i];
+		} else if (arg == "--load" && i + 1 < argc) {
+			options.load = argv[++i];
+		} else if (arg == "--stats") {
+			options.stats = StatsFormat::TEXT;
+		} else if (arg == "--stats=json") {
+			options.stats = StatsFormat::JSON;
+		} else if (arg == "--cache-stats") {
+			options.cache_stats = true;
+		} else if (arg == "-j" && i + 1 < argc) {
+			options.threads = std::strtoul(argv[++i], nullptr, 10);
+			if (options.threads == 0) {
+				std::cerr << "Thread count must be a positive number\n";
+				return 1;
+			}
+		} else {
+			std::cerr << "Unknown option: " << arg << "\n";
+			PrintUsage(argv[0]);
+			return 1;
 		}
-		ProcessInput(input);
-		std::cout << ">>> ";
 	}
-}
\ No newline at end of file
+
+	options.batch = options.file != nullptr || !isatty(STDIN_FILENO);
+	options.calculator.stats = options.stats != StatsFormat::NONE;
+	switch (options.precision) {
+	case Precision::DOUBLE:
+		return Run<double>(options);
+	case Precision::LONG_DOUBLE:
+		return Run<long double>(options);
+	default:
+		return Run<float>(options);
+	}
+}
+#endif
@@ -0,0 +1,5149 @@
+// Expression engine: lexer, parser, optimiser, bytecode VM, column evaluator,
+// JIT and the Calculator context that ties them together. Everything is a
+// template on the number type, libcalculator.cpp instantiates it for float,
+// double and long double
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <locale>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Bump allocator, objects created in an arena are never destroyed individually,
+// all memory is released at once when the arena is reset or destroyed
+class Arena {
+public:
+	Arena(size_t block_size = 4096) : block_size(block_size), current(nullptr), remaining(0) {
+	}
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	template <typename T, typename... Args>
+	T* Create(Args&&... args) {
+		static_assert(std::is_trivially_destructible<T>::value, "Destructors of arena objects are never run");
+		void* memory = Allocate(sizeof(T), alignof(T));
+		return new (memory) T(std::forward<Args>(args)...);
+	}
+
+	void* Allocate(size_t size, size_t alignment) {
+		size_t padding = (alignment - reinterpret_cast<uintptr_t>(current) % alignment) % alignment;
+		if (current == nullptr || padding + size > remaining) {
+			NewBlock(size + alignment);
+			padding = (alignment - reinterpret_cast<uintptr_t>(current) % alignment) % alignment;
+		}
+
+		char* memory = current + padding;
+		current += padding + size;
+		remaining -= padding + size;
+		return memory;
+	}
+
+	// Keeps one block around so an arena reused between expressions only
+	// allocates once. When an expression needed several blocks they are replaced
+	// by a single one as large as all of them, so the next one fits
+	void Reset() {
+		if (blocks.empty()) {
+			return;
+		}
+		if (blocks.size() > 1) {
+			size_t total = 0;
+			for (const Block& block : blocks) {
+				total += block.size;
+			}
+			blocks.clear();
+			NewBlock(total);
+			return;
+		}
+		current = blocks[0].data.get();
+		remaining = blocks[0].size;
+	}
+
+private:
+	struct Block {
+		std::unique_ptr<char[]> data;
+		size_t size;
+	};
+
+	size_t block_size;
+	char* current;
+	size_t remaining;
+	std::vector<Block> blocks;
+
+private:
+	// Every block is at least twice the one before, so a huge expression takes
+	// a few dozen allocations rather than one per block_size of nodes
+	void NewBlock(size_t min_size) {
+		size_t size = std::max(blocks.empty() ? block_size : blocks.back().size * 2, min_size);
+		blocks.push_back(Block{std::unique_ptr<char[]>(new char[size]), size});
+		current = blocks.back().data.get();
+		remaining = size;
+	}
+};
+
+// Stack whose storage comes from an arena. Growing copies the elements into a
+// block twice the size and leaves the old one behind in the arena
+template <typename T>
+class ArenaStack {
+public:
+	ArenaStack(Arena& arena, size_t capacity = 16) : arena(arena), data(Allocate(capacity)), size(0), capacity(capacity) {
+		static_assert(std::is_trivially_copyable<T>::value, "Elements are moved with memcpy");
+	}
+
+	void Push(const T& value) {
+		if (size == capacity) {
+			T* grown = Allocate(capacity * 2);
+			std::memcpy(grown, data, size * sizeof(T));
+			data = grown;
+			capacity *= 2;
+		}
+		data[size++] = value;
+	}
+
+	T Pop() {
+		return data[--size];
+	}
+
+	T& Top() {
+		return data[size - 1];
+	}
+
+	const T& Top() const {
+		return data[size - 1];
+	}
+
+	bool IsEmpty() const {
+		return size == 0;
+	}
+
+private:
+	Arena& arena;
+	T* data;
+	size_t size;
+	size_t capacity;
+
+private:
+	T* Allocate(size_t count) {
+		return static_cast<T*>(arena.Allocate(count * sizeof(T), alignof(T)));
+	}
+};
+
+class Error {
+public:
+	enum class Type { NO_ERROR, INVALID_CHAR, INVALID_TOKEN, END_OF_STREAM, UNKNOWN_VARIABLE, UNKNOWN_FUNCTION, TOO_DEEP, TOO_LONG, CIRCULAR_DEFINITION };
+
+	constexpr Error(Error::Type type, size_t location, std::string_view source) : type(type), location(location), source(source) {
+	}
+
+	constexpr operator bool() const {
+		return type != Type::NO_ERROR;
+	}
+
+	friend std::ostream& operator<<(std::ostream& out, Error error) {
+		if (error.type == Type::INVALID_CHAR) {
+			out << "Error: Unexpected Character: '" << error.source[error.location] << "'\n";
+		} else if (error.type == Type::INVALID_TOKEN) {
+			out << "Error: Unexpected Token\n";
+		} else if (error.type == Type::END_OF_STREAM) {
+			out << "Error: Unexpected End Of Stream\n";
+		} else if (error.type == Type::UNKNOWN_VARIABLE) {
+			out << "Error: Unknown Variable: '" << error.GetName() << "'\n";
+		} else if (error.type == Type::UNKNOWN_FUNCTION) {
+			out << "Error: Unknown Function: '" << error.GetName() << "'\n";
+		} else if (error.type == Type::TOO_DEEP) {
+			out << "Error: Expression Nested Too Deeply\n";
+		} else if (error.type == Type::TOO_LONG) {
+			// The source is not echoed, it is far too long to show
+			return out << "Error: Expression Too Long";
+		} else if (error.type == Type::CIRCULAR_DEFINITION) {
+			out << "Error: Circular Definition: '" << error.GetName() << "'\n";
+		}
+
+		out << "    " << error.source << "\n";
+		// Padded by the stream rather than with a string of spaces, so reporting
+		// an error does not allocate
+		const char* const marker = "^---- Here";
+		out.width(static_cast<std::streamsize>(error.location + 4 + std::strlen(marker)));
+		out << marker;
+
+		return out;
+	}
+
+	Type type;
+	size_t location;
+	std::string_view source;
+
+private:
+	// The variable or function name an error points at
+	std::string_view GetName() const {
+		std::string_view name = source.substr(location);
+		size_t length = 0;
+		while (length < name.size() && (std::isalnum(static_cast<unsigned char>(name[length])) || name[length] == '_')) {
+			length++;
+		}
+		return name.substr(0, length);
+	}
+};
+
+// Reads the digits of a literal, digits with at most one decimal point, as an
+// integer scaled by a power of ten. Returns false if it has more than 19
+// significant digits, the ones after them are then dropped
+constexpr bool ReadDecimal(const char* first, const char* last, uint64_t& digits, int& exponent) {
+	digits = 0;
+	exponent = 0;
+	// Any literal of up to 19 digits fits, whatever its leading zeros
+	if (last - first <= 19) {
+		const char* point = last;
+		for (const char* ch = first; ch != last; ch++) {
+			if (*ch == '.') {
+				point = ch;
+			} else {
+				digits = digits * 10 + static_cast<uint64_t>(*ch - '0');
+			}
+		}
+		exponent = point == last ? 0 : -static_cast<int>(last - point - 1);
+		return true;
+	}
+
+	int significant = 0;
+	bool fraction = false;
+	bool exact = true;
+	for (; first != last; first++) {
+		if (*first == '.') {
+			fraction = true;
+		} else if (significant < 19) {
+			digits = digits * 10 + static_cast<uint64_t>(*first - '0');
+			significant += digits != 0;
+			exponent -= fraction;
+		} else {
+			exponent += !fraction;
+			exact = false;
+		}
+	}
+	return exact;
+}
+
+// Describes how values of a number type are parsed and printed. Any trivially
+// copyable type with arithmetic operators can be used as a number, a type that
+// std::from_chars() does not support (such as a fixed width decimal) needs its
+// own specialisation with the same members
+template <typename Number>
+struct NumberTraits {
+	static_assert(std::is_trivially_copyable<Number>::value, "Numbers are stored in arena nodes and instructions");
+
+	// Significant digits printed for results, for float this is the default
+	// stream precision of 6
+	static constexpr int PRECISION = std::numeric_limits<Number>::digits10;
+
+	// Parsers look literals up in a hash table so equal ones are only built once.
+	// Literals are equal if they have the same bits, as 0 and -0 are different
+	// operands to a division
+	static size_t Hash(Number value) {
+		if constexpr (std::is_same<Number, float>::value || std::is_same<Number, double>::value) {
+			uint64_t bits = 0;
+			std::memcpy(&bits, &value, sizeof(Number));
+			return bits;
+		} else {
+			return std::hash<Number>()(value);
+		}
+	}
+
+	static bool Equal(Number lhs, Number rhs) {
+		if constexpr (std::is_floating_point<Number>::value) {
+			return lhs == rhs && std::signbit(lhs) == std::signbit(rhs);
+		} else {
+			return lhs == rhs;
+		}
+	}
+
+	// Only the powers that are exact in Number are used
+	static constexpr Number POWERS_OF_TEN[] = {1e0L,  1e1L,  1e2L,  1e3L,  1e4L,  1e5L,  1e6L,  1e7L,  1e8L,  1e9L,
+											   1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+											   1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L};
+
+	// Converts a literal with a single rounding if its digits and the power of
+	// ten that scales them are both exact in Number, which gives the result
+	// from_chars() would. Returns false for other literals
+	static constexpr bool ParseExact(const char* first, const char* last, Number& value) {
+		if constexpr (std::is_floating_point<Number>::value) {
+			uint64_t digits = 0;
+			int exponent = 0;
+			if (!ReadDecimal(first, last, digits, exponent)) {
+				return false;
+			}
+			if constexpr (std::numeric_limits<Number>::digits < 64) {
+				if (digits >= uint64_t(1) << std::numeric_limits<Number>::digits) {
+					return false;
+				}
+			}
+			// 10^n is exact while 5^n fits in the significand
+			constexpr int EXACT_POWERS = std::numeric_limits<Number>::digits >= 64 ? 27 : std::numeric_limits<Number>::digits >= 53 ? 22 : 10;
+			static_assert(std::numeric_limits<Number>::digits >= 24, "Numbers need at least the precision of float");
+			if (exponent < -EXACT_POWERS || exponent > EXACT_POWERS) {
+				return false;
+			}
+			Number power = POWERS_OF_TEN[exponent < 0 ? -exponent : exponent];
+			value = exponent < 0 ? static_cast<Number>(digits) / power : static_cast<Number>(digits) * power;
+			return true;
+		} else {
+			return false;
+		}
+	}
+
+	// Parses a literal that the lexer has already validated, digits with at most
+	// one decimal point. Literals out of range become infinity or zero
+	static Number Parse(const char* first, const char* last) {
+		Number value;
+		if (ParseExact(first, last, value)) {
+			return value;
+		}
+		// from_chars() parses straight out of the source with no copy and does not
+		// depend on the locale
+		if (std::from_chars(first, last, value).ec == std::errc::result_out_of_range) {
+			// Without an exponent a literal can only overflow if it has a non zero
+			// integer part, otherwise it is too small to represent
+			const char* leading = std::find_if(first, last, [](char ch) { return ch != '0'; });
+			bool overflow = leading != last && *leading != '.';
+			value = overflow ? std::numeric_limits<Number>::infinity() : Number(0);
+		}
+		return value;
+	}
+};
+
+// One byte, so a token type stored in a buffer is not a char that may alias
+// every other value
+enum class TokenType : uint8_t { ADD, SUB, MUL, DIV, POW, MOD, LITERAL, RIGHT_PAREN, LEFT_PAREN, COMMA, IDENTIFIER };
+
+template <typename Number = float>
+class Token {
+public:
+	typedef TokenType Type;
+
+	Token(Type type) : token_type(type) {
+	}
+
+	Token(Number value) : token_type(Type::LITERAL), literal_value(value) {
+	}
+
+	Token(std::string_view name) : token_type(Type::IDENTIFIER), name(name) {
+	}
+
+	Type token_type;
+	Number literal_value;
+	std::string_view name;
+};
+
+// Packed structure of arrays storage for a scanned token stream. Every token
+// costs a type byte and a 32 bit position, literal values and identifier names go
+// to side tables that only have entries for those tokens. Positions must fit in
+// 32 bits, so Lexer::Scan() rejects longer sources
+template <typename Number = float>
+class TokenBuffer {
+public:
+	static constexpr size_t MAX_SOURCE_LENGTH = UINT32_MAX;
+
+	// A source of n characters has at most n tokens, so the types and positions
+	// are allocated once and pushes write them without a capacity check. The
+	// side tables are sized from the expected number of literals and names,
+	// reserving them for the worst case would cost more than the tokens, and
+	// grow past it if needed. Must be called before any push
+	void Reserve(size_t source_length, size_t literal_count, size_t name_count) {
+		types.reset(new TokenType[source_length]);
+		positions.reset(new uint32_t[source_length]);
+		capacity = source_length;
+		size = 0;
+		literals.reserve(literal_count);
+		names.reserve(name_count);
+	}
+
+	// Pushes a token of a type without side table entries
+	void PushOperator(TokenType type, size_t position) {
+		types[size] = type;
+		positions[size] = static_cast<uint32_t>(position);
+		size++;
+	}
+
+	void PushLiteral(Number value, size_t position) {
+		PushOperator(TokenType::LITERAL, position);
+		literals.push_back(value);
+	}
+
+	void PushName(std::string_view name, size_t position) {
+		PushOperator(TokenType::IDENTIFIER, position);
+		names.push_back(name);
+	}
+
+	size_t GetSize() const {
+		return size;
+	}
+
+	TokenType GetType(size_t index) const {
+		return types[index];
+	}
+
+	size_t GetPosition(size_t index) const {
+		return positions[index];
+	}
+
+	// Indexed by the number of literal tokens before this one
+	Number GetLiteral(size_t literal_index) const {
+		return literals[literal_index];
+	}
+
+	// Indexed by the number of identifier tokens before this one
+	std::string_view GetName(size_t name_index) const {
+		return names[name_index];
+	}
+
+	// Bytes allocated for the tokens, including reserved capacity
+	size_t GetMemoryUsage() const {
+		return capacity * (sizeof(TokenType) + sizeof(uint32_t)) + literals.capacity() * sizeof(Number) +
+			   names.capacity() * sizeof(std::string_view);
+	}
+
+private:
+	std::unique_ptr<TokenType[]> types;
+	std::unique_ptr<uint32_t[]> positions;
+	size_t capacity = 0;
+	size_t size = 0;
+	std::vector<Number> literals;
+	std::vector<std::string_view> names;
+};
+
+template <typename Number = float>
+class Lexer {
+public:
+	Lexer(std::string_view source) : position(0), tokens(), source(source) {
+	}
+
+	// Lexes the whole source into the token buffer. A source with positions that
+	// do not fit the buffer is rejected before anything is scanned. The source
+	// is classified 64 bytes at a time into bit masks, then the tokens are
+	// emitted from the set bits of the structural characters: operators, invalid
+	// characters and the first character of every run of word characters.
+	// Whitespace is never looked at one byte at a time, and a run that is a
+	// single literal or name is pushed without scanning it again
+	Error Scan() {
+		if (source.length() > TokenBuffer<Number>::MAX_SOURCE_LENGTH) {
+			return Error(Error::Type::TOO_LONG, 0, source);
+		}
+		// Classifying is cheap next to growing the side tables, so a first pass
+		// counts the runs that start with a digit or a letter to size them. Only
+		// runs such as "2x" hold more than one token
+		size_t literal_runs = 0;
+		size_t name_runs = 0;
+		uint64_t carry = 0;
+		for (size_t base = 0; base < source.length(); base += BLOCK_SIZE) {
+			CharacterMasks masks = ClassifyAt(base);
+			uint64_t word_starts = masks.words & ~((masks.words << 1) | carry);
+			carry = masks.words >> (BLOCK_SIZE - 1);
+			literal_runs += static_cast<size_t>(__builtin_popcountll(word_starts & masks.digits));
+			name_runs += static_cast<size_t>(__builtin_popcountll(word_starts & ~(masks.digits | masks.points)));
+		}
+		tokens.Reserve(source.length(), literal_runs, name_runs);
+
+		// Set when the last byte of the previous block is a word character
+		carry = 0;
+		for (size_t base = 0; base < source.length(); base += BLOCK_SIZE) {
+			CharacterMasks masks = ClassifyAt(base);
+			uint64_t invalid = ~(masks.whitespace | masks.operators | masks.words);
+			uint64_t word_starts = masks.words & ~((masks.words << 1) | carry);
+			carry = masks.words >> (BLOCK_SIZE - 1);
+			uint64_t structural = masks.operators | invalid | word_starts;
+			while (structural != 0) {
+				size_t offset = static_cast<size_t>(__builtin_ctzll(structural));
+				structural &= structural - 1;
+				uint64_t bit = uint64_t(1) << offset;
+				size_t index = base + offset;
+
+				if (masks.operators & bit) {
+					tokens.PushOperator(OPERATOR_TYPES[static_cast<unsigned char>(source[index])], index);
+				} else if (invalid & bit) {
+					position = index;
+					return Error(Error::Type::INVALID_CHAR, index, source);
+				} else {
+					// The run ends inside the block unless every byte after its
+					// start is a word character. A run of digits with at most one
+					// point is a single literal, a run that starts with a letter
+					// and has no point is a single name
+					size_t end = offset + static_cast<size_t>(__builtin_ctzll(~(masks.words >> offset)));
+					uint64_t run = (uint64_t(2) << (end - 1)) - bit;
+					size_t length = end - offset;
+					if (end < BLOCK_SIZE && (masks.digits & bit) && (run & ~(masks.digits | masks.points)) == 0 &&
+						(run & masks.points & (run & masks.points) - 1) == 0) {
+						tokens.PushLiteral(NumberTraits<Number>::Parse(source.data() + index, source.data() + index + length), index);
+					} else if (end < BLOCK_SIZE && ((masks.digits | masks.points) & bit) == 0 && (run & masks.points) == 0) {
+						tokens.PushName(source.substr(index, length), index);
+					} else {
+						position = index;
+						if (Error error = ScanWord()) {
+							return error;
+						}
+					}
+				}
+			}
+		}
+		position = source.length();
+		return Error(Error::Type::NO_ERROR, 0, source);
+	}
+
+	// Skips whitespace and lexes a single token, giving the tokens Scan() does one
+	// at a time. Returns false once the source is exhausted, or with error set if
+	// an invalid character was found
+	bool Next(Token<Number>& token, size_t& token_position, Error& error) {
+		while (position < source.length() && IsWhiteSpace(source[position])) {
+			position++;
+		}
+		if (position == source.length()) {
+			return false;
+		}
+
+		token_position = position;
+		switch (source[position]) {
+		case '+':
+			token = Token<Number>(TokenType::ADD);
+			position++;
+			return true;
+		case '-':
+			token = Token<Number>(TokenType::SUB);
+			position++;
+			return true;
+		case '*':
+			token = Token<Number>(TokenType::MUL);
+			position++;
+			return true;
+		case '/':
+			token = Token<Number>(TokenType::DIV);
+			position++;
+			return true;
+		case '^':
+			token = Token<Number>(TokenType::POW);
+			position++;
+			return true;
+		case '%':
+			token = Token<Number>(TokenType::MOD);
+			position++;
+			return true;
+		case ',':
+			token = Token<Number>(TokenType::COMMA);
+			position++;
+			return true;
+		case '(':
+			token = Token<Number>(TokenType::LEFT_PAREN);
+			position++;
+			return true;
+		case ')':
+			token = Token<Number>(TokenType::RIGHT_PAREN);
+			position++;
+			return true;
+		default:
+			if (IsIdentifierStart(source[position])) {
+				token = Token<Number>(GetIdentifier());
+				return true;
+			}
+			auto [value, success] = GetLiteral();
+			if (!success) {
+				error = Error(Error::Type::INVALID_CHAR, position, source);
+				return false;
+			}
+			token = Token<Number>(value);
+			return true;
+		}
+	}
+
+	const TokenBuffer<Number>& GetTokens() {
+		return tokens;
+	}
+
+	// The characters std::isspace() accepts in the "C" locale, whatever the
+	// current locale is
+	static bool IsWhiteSpace(char ch) {
+		return ch == ' ' || (ch >= '\t' && ch <= '\r');
+	}
+
+	// Characters that can be part of a literal or a name
+	static bool IsWordChar(char ch) {
+		return IsDigit(ch) || IsIdentifierStart(ch) || ch == '.';
+	}
+
+private:
+	static constexpr size_t BLOCK_SIZE = 64;
+
+	// Bit i of a mask is set when byte i of a block is in the class. Bytes in
+	// none of whitespace, operators or words are invalid
+	struct CharacterMasks {
+		uint64_t whitespace;
+		uint64_t operators;
+		uint64_t words;
+		uint64_t digits;
+		uint64_t points;
+	};
+
+	static constexpr std::array<TokenType, 256> OPERATOR_TYPES = []() {
+		std::array<TokenType, 256> types{};
+		types['+'] = TokenType::ADD;
+		types['-'] = TokenType::SUB;
+		types['*'] = TokenType::MUL;
+		types['/'] = TokenType::DIV;
+		types['^'] = TokenType::POW;
+		types['%'] = TokenType::MOD;
+		types[','] = TokenType::COMMA;
+		types['('] = TokenType::LEFT_PAREN;
+		types[')'] = TokenType::RIGHT_PAREN;
+		return types;
+	}();
+
+	size_t position;
+	TokenBuffer<Number> tokens;
+	std::string_view source;
+
+private:
+	// The last block is padded with whitespace, which ends any run
+	CharacterMasks ClassifyAt(size_t base) const {
+		if (source.length() - base >= BLOCK_SIZE) {
+			return Classify(source.data() + base);
+		}
+		char padded[BLOCK_SIZE];
+		std::memset(padded, ' ', BLOCK_SIZE);
+		std::memcpy(padded, source.data() + base, source.length() - base);
+		return Classify(padded);
+	}
+
+#if defined(__SSE2__)
+	// Classifies 16 bytes at a time with compares, the operators are the range
+	// "(" to "-" and three single characters
+	static CharacterMasks Classify(const char* block) {
+		CharacterMasks masks = {0, 0, 0, 0, 0};
+		for (size_t i = 0; i < BLOCK_SIZE; i += 16) {
+			__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+			// Bytes of 128 and above compare as negative and are in no range
+			auto in_range = [](__m128i x, char first, char last) {
+				return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(static_cast<char>(first - 1))),
+									 _mm_cmplt_epi8(x, _mm_set1_epi8(static_cast<char>(last + 1))));
+			};
+			auto equal = [](__m128i x, char ch) { return _mm_cmpeq_epi8(x, _mm_set1_epi8(ch)); };
+
+			__m128i whitespace = _mm_or_si128(equal(bytes, ' '), in_range(bytes, '\t', '\r'));
+			__m128i operators = _mm_or_si128(_mm_or_si128(in_range(bytes, '(', '-'), equal(bytes, '%')),
+											 _mm_or_si128(equal(bytes, '/'), equal(bytes, '^')));
+			__m128i digits = in_range(bytes, '0', '9');
+			__m128i points = equal(bytes, '.');
+			__m128i letters = in_range(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 'z');
+			__m128i words = _mm_or_si128(_mm_or_si128(digits, points), _mm_or_si128(letters, equal(bytes, '_')));
+
+			auto bits = [](__m128i mask) { return static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(mask))); };
+			masks.whitespace |= bits(whitespace) << i;
+			masks.operators |= bits(operators) << i;
+			masks.words |= bits(words) << i;
+			masks.digits |= bits(digits) << i;
+			masks.points |= bits(points) << i;
+		}
+		return masks;
+	}
+#else
+	static CharacterMasks Classify(const char* block) {
+		CharacterMasks masks = {0, 0, 0, 0, 0};
+		for (size_t i = 0; i < BLOCK_SIZE; i++) {
+			char ch = block[i];
+			uint64_t bit = uint64_t(1) << i;
+			masks.whitespace |= IsWhiteSpace(ch) ? bit : 0;
+			masks.operators |= ch == '%' || ch == '/' || ch == '^' || (ch >= '(' && ch <= '-') ? bit : 0;
+			masks.words |= IsWordChar(ch) ? bit : 0;
+			masks.digits |= IsDigit(ch) ? bit : 0;
+			masks.points |= ch == '.' ? bit : 0;
+		}
+		return masks;
+	}
+#endif
+
+	// Lexes the literals and names of a run of word characters starting at
+	// position, a run such as "2x" or "1.5.5" that is not a single literal
+	Error ScanWord() {
+		while (position < source.length() && IsWordChar(source[position])) {
+			size_t start = position;
+			if (IsIdentifierStart(source[position])) {
+				tokens.PushName(GetIdentifier(), start);
+				continue;
+			}
+			auto [value, success] = GetLiteral();
+			if (!success) {
+				return Error(Error::Type::INVALID_CHAR, position, source);
+			}
+			tokens.PushLiteral(value, start);
+		}
+		return Error(Error::Type::NO_ERROR, 0, source);
+	}
+
+	static bool IsDigit(char ch) {
+		return ch >= '0' && ch <= '9';
+	}
+
+	// The source is not null terminated, so every lookahead must be bounds checked
+	bool IsDigitAt(size_t index) {
+		return index < source.length() && IsDigit(source[index]);
+	}
+
+	bool IsDecimalPointAt(size_t index) {
+		return index < source.length() && source[index] == '.';
+	}
+
+	static bool IsIdentifierStart(char ch) {
+		return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_';
+	}
+
+	std::string_view GetIdentifier() {
+		size_t start = position;
+		while (position < source.length() && (IsIdentifierStart(source[position]) || IsDigit(source[position]))) {
+			position++;
+		}
+		return source.substr(start, position - start);
+	}
+
+	std::pair<Number, bool> GetLiteral() {
+		if (!IsDigit(source[position])) { // ".234" is considered an error
+			return {0, false};
+		}
+		size_t start = position;
+		bool has_decimal_point = false;
+
+		while (IsDigitAt(position) || (!has_decimal_point && IsDecimalPointAt(position))) {
+			if (source[position] == '.') {
+				has_decimal_point = true;
+			}
+			position++;
+		}
+
+		return {NumberTraits<Number>::Parse(source.data() + start, source.data() + position), true};
+	}
+};
+
+// Kernels of exp() and log() that must round alike on every target are kept
+// from being contracted into fused multiply-adds, which only some have
+#if defined(__GNUC__) && !defined(__clang__)
+#define CALCULATOR_NO_CONTRACT __attribute__((optimize("fp-contract=off")))
+#else
+#define CALCULATOR_NO_CONTRACT
+#endif
+
+// exp() and log() of doubles after fdlibm's e_exp.c and e_log.c, within an ulp
+// of the exact result. The tree, the VM, constant expressions and the column
+// evaluator all run these rather than the library's, so they give the same
+// bits. They have no branches, a loop over them vectorises with the
+// instruction set of the function it is inlined into
+class MathKernels {
+public:
+	__attribute__((always_inline)) static constexpr double Exp(double x) {
+		constexpr double P1 = 1.66666666666666019037e-01;
+		constexpr double P2 = -2.77777777770155933842e-03;
+		constexpr double P3 = 6.61375632143793436117e-05;
+		constexpr double P4 = -1.65339022054652515390e-06;
+		constexpr double P5 = 4.13813679705723846039e-08;
+		// exp() is 0 or infinity beyond these
+		double clamped = Select(x > 710.0, 710.0, x);
+		clamped = Select(clamped < -746.0, -746.0, clamped);
+		clamped = Select(x != x, 0, clamped);
+
+		// x = k * ln(2) + r, with |r| <= ln(2) / 2
+		double shifted = clamped * INV_LN2 + SHIFTER;
+		double k = shifted - SHIFTER;
+		double hi = clamped - k * LN2_HI;
+		double lo = k * LN2_LO;
+		double r = hi - lo;
+		double r2 = r * r;
+		double c = r - r2 * (P1 + r2 * (P2 + r2 * (P3 + r2 * (P4 + r2 * P5))));
+		double y = 1.0 - ((lo - (r * c) / (2.0 - c)) - hi);
+
+		double low = 0, high = 0;
+		SplitPowerOfTwo(shifted, low, high);
+		return Select(x != x, x, y * low * high);
+	}
+
+	__attribute__((always_inline)) static constexpr double Log(double x) {
+		constexpr double LG1 = 6.666666666666735130e-01;
+		constexpr double LG2 = 3.999999999940941908e-01;
+		constexpr double LG3 = 2.857142874366239149e-01;
+		constexpr double LG4 = 2.222219843214978396e-01;
+		constexpr double LG5 = 1.818357216161805012e-01;
+		constexpr double LG6 = 1.531383769920937332e-01;
+		constexpr double LG7 = 1.479819860511658591e-01;
+		constexpr double INFINITY_VALUE = std::numeric_limits<double>::infinity();
+		// Subnormals are scaled into normal numbers. Zero, negative and special
+		// values are decomposed as 1 and replaced at the end
+		double scale = Select(x < MIN_NORMAL, 54.0, 0.0);
+		double normal = x * Select(x < MIN_NORMAL, TWO_54, 1.0);
+		normal = Select((normal > 0) & (normal < INFINITY_VALUE), normal, 1.0);
+
+		// x = 2^k * m, with m in [sqrt(2) / 2, sqrt(2))
+		double m = 0, k = 0;
+		Decompose(normal, m, k);
+		k += Select(m > SQRT2, 1.0, 0.0) - scale;
+		m *= Select(m > SQRT2, 0.5, 1.0);
+
+		double f = m - 1.0;
+		double s = f / (2.0 + f);
+		double z = s * s;
+		double w = z * z;
+		double odd = z * (LG1 + w * (LG3 + w * (LG5 + w * LG7)));
+		double even = w * (LG2 + w * (LG4 + w * LG6));
+		double half_square = 0.5 * f * f;
+		double y = k * LN2_HI - ((half_square - (s * (half_square + odd + even) + k * LN2_LO)) - f);
+
+		y = Select(x == 0, -INFINITY_VALUE, y);
+		y = Select(x == INFINITY_VALUE, x, y);
+		y = Select(x < 0, std::numeric_limits<double>::quiet_NaN(), y);
+		return Select(x != x, x, y);
+	}
+
+	// x^y of two floats as exp(y * log(|x|)). Its error is far below half an ulp
+	// of float, so it rounds to the same float as the exact power but near
+	// halfway cases. Exact powers such as 2^10 are exact. Signs and special
+	// values are those of C's pow()
+	__attribute__((always_inline)) static constexpr double Pow(double x, double y) {
+		constexpr double INFINITY_VALUE = std::numeric_limits<double>::infinity();
+		double magnitude = Exp(y * Log(Select(x < 0, -x, x)));
+
+		// Only integers leave |y| unchanged when rounded, the ones of 2^51 and
+		// above are all even
+		double abs_y = Select(y < 0, -y, y);
+		double half = abs_y * 0.5;
+		bool integer = Select(abs_y < TWO_51, (abs_y + SHIFTER) - SHIFTER, abs_y) == abs_y;
+		bool odd = integer & (Select(half < TWO_51, (half + SHIFTER) - SHIFTER, half) != half);
+
+		double power = Select(odd & IsNegative(x), -magnitude, magnitude);
+		power = Select((x < 0) & (x > -INFINITY_VALUE) & !integer, std::numeric_limits<double>::quiet_NaN(), power);
+		return Select((y == 0) | (x == 1) | ((x == -1) & (abs_y == INFINITY_VALUE)), 1.0, power);
+	}
+
+	// fmod(x, y) of two floats, but only while |x / y| < 2^24: the quotient then
+	// truncates to the right integer in double and every step is exact. Larger
+	// quotients such as 1e30 % 3 or 5.5 % 1e-30 would need the quotient to more
+	// bits than a double holds, so for them it returns NaN although fmod() is
+	// finite, as it does for y == 0, an infinite x or a NaN. A NaN from Mod() is
+	// therefore not a result: callers run std::fmod() again on those lanes, as
+	// ApplyToBlocks() does
+	__attribute__((always_inline)) static double Mod(double x, double y) {
+		constexpr double INFINITY_VALUE = std::numeric_limits<double>::infinity();
+		double quotient = x / y;
+		bool exact = (quotient < TWO_24) & (quotient > -TWO_24);
+		// Whole numbers below 2^24 convert through int32 without overflow
+		double whole = static_cast<double>(static_cast<int32_t>(Select(exact, quotient, 0.0)));
+		double remainder = x - whole * y;
+		// A zero remainder has the sign of x, and x is finite
+		remainder = Select(remainder == 0, x * 0, remainder);
+		remainder = Select((y == INFINITY_VALUE) | (y == -INFINITY_VALUE), x, remainder);
+		return Select(exact, remainder, std::numeric_limits<double>::quiet_NaN());
+	}
+
+private:
+	static constexpr double LN2_HI = 6.93147180369123816490e-01;
+	static constexpr double LN2_LO = 1.90821492927058770002e-10;
+	static constexpr double INV_LN2 = 1.44269504088896338700e+00;
+	static constexpr double SQRT2 = 1.41421356237309504880;
+	static constexpr double MIN_NORMAL = 2.2250738585072014e-308;
+	static constexpr double TWO_54 = 18014398509481984.0;
+	static constexpr double TWO_51 = 2251799813685248.0;
+	static constexpr double TWO_24 = 16777216.0;
+	// Adding it rounds a double of magnitude below 2^51 to an integer, which is
+	// then held in the low bits of the sum
+	static constexpr double SHIFTER = 6755399441055744.0;
+	static constexpr uint64_t SHIFTER_BITS = 0x4338000000000000;
+	static constexpr double TWO_52 = 4503599627370496.0;
+	static constexpr uint64_t TWO_52_BITS = 0x4330000000000000;
+	static constexpr uint64_t EXPONENT_OF_ONE = uint64_t(1023) << 52;
+	static constexpr uint64_t MANTISSA_MASK = (uint64_t(1) << 52) - 1;
+
+	__attribute__((always_inline)) static uint64_t ToBits(double value) {
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	__attribute__((always_inline)) static double FromBits(uint64_t bits) {
+		double value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	// condition ? a : b. Trapping math keeps GCC from turning a ternary between
+	// computed values into a vector select, so the lanes are masked as integers
+	__attribute__((always_inline)) static constexpr double Select(bool condition, double a, double b) {
+		if (__builtin_is_constant_evaluated()) {
+			return condition ? a : b;
+		}
+		uint64_t mask = uint64_t(0) - condition;
+		return FromBits((ToBits(a) & mask) | (ToBits(b) & ~mask));
+	}
+
+	static constexpr double PowerOfTwo(int64_t k) {
+		double power = 1;
+		for (; k > 0; k--) {
+			power *= 2;
+		}
+		for (; k < 0; k++) {
+			power /= 2;
+		}
+		return power;
+	}
+
+	// Whether the sign bit is set, which tells -0 from 0
+	__attribute__((always_inline)) static constexpr bool IsNegative(double value) {
+		if (__builtin_is_constant_evaluated()) {
+			return __builtin_signbit(value);
+		}
+		return (ToBits(value) >> 63) != 0;
+	}
+
+	// Splits 2^k into two factors that are normal doubles for every k exp()
+	// reaches, shifted holds k as added to SHIFTER
+	__attribute__((always_inline)) static constexpr void SplitPowerOfTwo(double shifted, double& low, double& high) {
+		if (__builtin_is_constant_evaluated()) {
+			int64_t k = static_cast<int64_t>(shifted - SHIFTER);
+			int64_t half = k >= 0 ? k / 2 : -((1 - k) / 2);
+			low = PowerOfTwo(half);
+			high = PowerOfTwo(k - half);
+			return;
+		}
+		// k + 2048 is positive, so it is halved with a logical shift
+		uint64_t k = ToBits(shifted) - SHIFTER_BITS + 2048;
+		uint64_t half = k >> 1;
+		low = FromBits((half - 1) << 52);
+		high = FromBits((k - half - 1) << 52);
+	}
+
+	// x = 2^k * m with m in [1, 2), for a positive normal x
+	__attribute__((always_inline)) static constexpr void Decompose(double x, double& m, double& k) {
+		if (__builtin_is_constant_evaluated()) {
+			m = x;
+			k = 0;
+			for (; m >= 2; k++) {
+				m /= 2;
+			}
+			for (; m < 1; k--) {
+				m *= 2;
+			}
+			return;
+		}
+		uint64_t bits = ToBits(x);
+		// The biased exponent is read from the low bits of 2^52, which needs no
+		// integer conversion
+		k = FromBits(bits >> 52 | TWO_52_BITS) - (TWO_52 + 1023);
+		m = FromBits((bits & MANTISSA_MASK) | EXPONENT_OF_ONE);
+	}
+};
+
+// exp() and log() as the evaluators apply them. float and double use the
+// kernels out of line, so a caller built for a target with fused multiply-adds
+// still rounds like the column evaluator. Other number types use the library
+template <typename Number>
+constexpr Number Exponential(Number value) {
+	return std::exp(value);
+}
+
+CALCULATOR_NO_CONTRACT __attribute__((noinline)) constexpr double Exponential(double value) {
+	return MathKernels::Exp(value);
+}
+
+CALCULATOR_NO_CONTRACT __attribute__((noinline)) constexpr float Exponential(float value) {
+	return static_cast<float>(MathKernels::Exp(value));
+}
+
+template <typename Number>
+constexpr Number Logarithm(Number value) {
+	return std::log(value);
+}
+
+CALCULATOR_NO_CONTRACT __attribute__((noinline)) constexpr double Logarithm(double value) {
+	return MathKernels::Log(value);
+}
+
+CALCULATOR_NO_CONTRACT __attribute__((noinline)) constexpr float Logarithm(float value) {
+	return static_cast<float>(MathKernels::Log(value));
+}
+
+// x^y as the evaluators apply it. float uses the kernels out of line for the
+// same reason as exp(), the other types use the library
+template <typename Number>
+constexpr Number Power(Number lhs, Number rhs) {
+	return std::pow(lhs, rhs);
+}
+
+CALCULATOR_NO_CONTRACT __attribute__((noinline)) constexpr float Power(float lhs, float rhs) {
+	return static_cast<float>(MathKernels::Pow(lhs, rhs));
+}
+
+// Operators added later are numbered after RECALL, so the instructions of an
+// existing ProgramImage keep their meaning
+enum class OpCode : uint8_t { PUSH, LOAD, ADD, SUB, MUL, DIV, STORE, RECALL, NEG, POW, MOD, SQRT, EXP, LOG, MIN, MAX };
+
+// The arithmetic of each operator. The AST, the VM, the constant evaluator and
+// formulas all apply operators through it, so they give the same results. The
+// column evaluator and the JIT use the same IEEE operations on vectors and
+// registers, and the same kernels for exp() and log(). Unary operators take a
+// single operand
+template <OpCode OP>
+struct Operation;
+
+template <>
+struct Operation<OpCode::ADD> {
+	template <typename T>
+	static constexpr T Apply(T lhs, T rhs) {
+		return lhs + rhs;
+	}
+};
+
+template <>
+struct Operation<OpCode::SUB> {
+	template <typename T>
+	static constexpr T Apply(T lhs, T rhs) {
+		return lhs - rhs;
+	}
+};
+
+template <>
+struct Operation<OpCode::MUL> {
+	template <typename T>
+	static constexpr T Apply(T lhs, T rhs) {
+		return lhs * rhs;
+	}
+};
+
+template <>
+struct Operation<OpCode::DIV> {
+	template <typename T>
+	static constexpr T Apply(T lhs, T rhs) {
+		return lhs / rhs;
+	}
+};
+
+template <>
+struct Operation<OpCode::NEG> {
+	template <typename T>
+	static constexpr T Apply(T operand) {
+		return -operand;
+	}
+};
+
+template <>
+struct Operation<OpCode::POW> {
+	template <typename T>
+	static constexpr T Apply(T lhs, T rhs) {
+		return Power(lhs, rhs);
+	}
+};
+
+// The remainder has the sign of lhs, like C's fmod()
+template <>
+struct Operation<OpCode::MOD> {
+	template <typename T>
+	static constexpr T Apply(T lhs, T rhs) {
+		return std::fmod(lhs, rhs);
+	}
+};
+
+template <>
+struct Operation<OpCode::SQRT> {
+	template <typename T>
+	static constexpr T Apply(T operand) {
+		return std::sqrt(operand);
+	}
+};
+
+template <>
+struct Operation<OpCode::EXP> {
+	template <typename T>
+	static constexpr T Apply(T operand) {
+		return Exponential(operand);
+	}
+};
+
+template <>
+struct Operation<OpCode::LOG> {
+	template <typename T>
+	static constexpr T Apply(T operand) {
+		return Logarithm(operand);
+	}
+};
+
+// Gives rhs if either operand is NaN or both are zero, like SSE's minss and
+// maxss
+template <>
+struct Operation<OpCode::MIN> {
+	template <typename T>
+	static constexpr T Apply(T lhs, T rhs) {
+		return lhs < rhs ? lhs : rhs;
+	}
+};
+
+template <>
+struct Operation<OpCode::MAX> {
+	template <typename T>
+	static constexpr T Apply(T lhs, T rhs) {
+		return lhs > rhs ? lhs : rhs;
+	}
+};
+
+// The sign and payload of a NaN depend on which operations made it and on the
+// order the hardware applied them in, which differs between the evaluators and
+// between scalar and vector code. They never change a value that is not NaN, so
+// every evaluator passes its results through here and gives the same bits
+template <typename Number>
+constexpr Number CanonicalNaN(Number value) {
+	return value != value ? std::numeric_limits<Number>::quiet_NaN() : value;
+}
+
+template <typename Number = float>
+class Instruction {
+public:
+	Instruction(OpCode op) : op(op), value(0) {
+	}
+
+	Instruction(Number value) : op(OpCode::PUSH), value(value) {
+	}
+
+	// LOAD reads a variable's slot. STORE copies the value on top of the stack
+	// into a temporary, leaving it there, and RECALL pushes a temporary's value.
+	// Built in place rather than returned by a factory, as GCC notes an ABI
+	// change on returning a union with long double
+	Instruction(OpCode op, uint32_t slot) : op(op), slot(slot) {
+	}
+
+	OpCode op;
+	union {
+		Number value;  // PUSH
+		uint32_t slot; // LOAD, or the temporary of STORE and RECALL
+	};
+};
+
+// Number of values an instruction reads from the top of the stack
+constexpr size_t GetArity(OpCode op) {
+	switch (op) {
+	case OpCode::PUSH:
+	case OpCode::LOAD:
+	case OpCode::RECALL:
+		return 0;
+	case OpCode::STORE:
+	case OpCode::NEG:
+	case OpCode::SQRT:
+	case OpCode::EXP:
+	case OpCode::LOG:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+// Change in the depth of the stack after running an instruction
+inline int GetStackEffect(OpCode op) {
+	if (op == OpCode::STORE) {
+		return 0;
+	}
+	return 1 - static_cast<int>(GetArity(op));
+}
+
+// Instructions a program runs, either its own or those of a ProgramImage
+template <typename Number = float>
+class InstructionRange {
+public:
+	InstructionRange(const Instruction<Number>* first, size_t size) : first(first), count(size) {
+	}
+
+	const Instruction<Number>* begin() const {
+		return first;
+	}
+
+	const Instruction<Number>* end() const {
+		return first + count;
+	}
+
+	const Instruction<Number>* data() const {
+		return first;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+private:
+	const Instruction<Number>* first;
+	size_t count;
+};
+
+// Flat list of instructions for a stack machine, produced by walking the AST in
+// post order
+template <typename Number = float>
+class Program {
+public:
+	Program() : mapped(nullptr), mapped_size(0), max_depth(0), depth(0), temporaries(0) {
+	}
+
+	// A mapped program must be cleared before emitting into it
+	void Emit(const Instruction<Number>& instruction) {
+		depth += GetStackEffect(instruction.op);
+		max_depth = std::max(max_depth, depth);
+		instructions.push_back(instruction);
+	}
+
+	// Runs instructions that stay in the caller's memory, which must outlive the
+	// program and every copy of it
+	void Map(const Instruction<Number>* instructions, size_t size, size_t max_depth, size_t temporaries) {
+		Clear();
+		mapped = instructions;
+		mapped_size = size;
+		this->max_depth = max_depth;
+		this->temporaries = temporaries;
+	}
+
+	// Returns a temporary for the value of a subexpression the program uses more
+	// than once
+	uint32_t AddTemporary() {
+		return static_cast<uint32_t>(temporaries++);
+	}
+
+	void Clear() {
+		instructions.clear();
+		mapped = nullptr;
+		mapped_size = 0;
+		max_depth = 0;
+		depth = 0;
+		temporaries = 0;
+	}
+
+	void Swap(Program& other) {
+		instructions.swap(other.instructions);
+		std::swap(mapped, other.mapped);
+		std::swap(mapped_size, other.mapped_size);
+		std::swap(max_depth, other.max_depth);
+		std::swap(depth, other.depth);
+		std::swap(temporaries, other.temporaries);
+	}
+
+	InstructionRange<Number> GetInstructions() const {
+		if (mapped != nullptr) {
+			return InstructionRange<Number>(mapped, mapped_size);
+		}
+		return InstructionRange<Number>(instructions.data(), instructions.size());
+	}
+
+	size_t GetMaxDepth() const {
+		return max_depth;
+	}
+
+	// Number of values an interpreter must hold for STORE and RECALL
+	size_t GetTemporaryCount() const {
+		return temporaries;
+	}
+
+	friend std::ostream& operator<<(std::ostream& out, const Program& program) {
+		static const char* names[] = {"PUSH", "LOAD", "ADD", "SUB", "MUL", "DIV", "STORE", "RECALL", "NEG", "POW", "MOD", "SQRT", "EXP", "LOG", "MIN", "MAX"};
+		InstructionRange<Number> instructions = program.GetInstructions();
+		for (size_t i = 0; i < instructions.size(); i++) {
+			const Instruction<Number>& instruction = instructions.data()[i];
+			out << i << ": " << names[static_cast<int>(instruction.op)];
+			if (instruction.op == OpCode::PUSH) {
+				out << " " << instruction.value;
+			} else if (instruction.op == OpCode::LOAD) {
+				out << " $" << instruction.slot;
+			} else if (instruction.op == OpCode::STORE || instruction.op == OpCode::RECALL) {
+				out << " #" << instruction.slot;
+			}
+			out << "\n";
+		}
+		return out;
+	}
+
+private:
+	std::vector<Instruction<Number>> instructions;
+	const Instruction<Number>* mapped;
+	size_t mapped_size;
+	size_t max_depth;
+	size_t depth;
+	size_t temporaries;
+};
+
+template <typename Number>
+class Expression;
+
+// Trees are walked recursively down to this depth, deeper subtrees are walked
+// with an explicit stack. Recursion is faster as the walk stays in registers,
+// but the native stack would overflow on the deep trees of generated input
+constexpr size_t RECURSION_LIMIT = 256;
+
+// Walks every path of a tree, so a node shared by several parents is visited
+// once for each of them. See WalkPostOrder()
+struct EnterAll {
+	template <typename Node>
+	bool operator()(Node*) const {
+		return true;
+	}
+};
+
+// Walks a tree in post-order with an explicit stack, so its depth is only limited
+// by memory. See WalkPostOrder()
+template <typename Number, typename Enter, typename Visit>
+size_t WalkIteratively(Expression<Number>*& root, Enter& enter, Visit& visit) {
+	struct Frame {
+		Expression<Number>** link;
+		size_t next;
+	};
+
+	// Reused by every walk on this thread so walking does not allocate, visit must
+	// therefore not start another iterative walk. The top of the stack is kept in
+	// a local so it can stay in a register
+	thread_local std::vector<Frame> storage(64);
+	Frame* base = storage.data();
+	Frame* top = base;
+	size_t depth = 0;
+
+	top->link = &root;
+	top->next = 0;
+	top++;
+	while (top != base) {
+		depth = std::max(depth, size_t(top - base));
+		Frame* frame = top - 1;
+		Expression<Number>* node = *frame->link;
+		if (frame->next < node->GetOperandCount()) {
+			Expression<Number>** operand = node->GetOperand(frame->next++);
+			if (!enter(*operand)) {
+				continue;
+			}
+			if (top == base + storage.size()) {
+				storage.resize(storage.size() * 2);
+				top = storage.data() + (top - base);
+				base = storage.data();
+			}
+			top->link = operand;
+			top->next = 0;
+			top++;
+		} else {
+			top--;
+			visit(*top->link);
+		}
+	}
+	return depth;
+}
+
+// Calls visit(link) for every node below and including *root after all of its
+// operands, link is the parent's pointer to the node and may be replaced. Every
+// operand is first passed to enter(), which returns false to skip it and its
+// subtree. The root is not passed to enter(). Returns the depth of the tree
+template <typename Number, typename Enter, typename Visit>
+size_t WalkPostOrder(Expression<Number>*& root, Enter& enter, Visit& visit, size_t depth = 0) {
+	size_t count = root->GetOperandCount();
+	if (count != 0 && depth == RECURSION_LIMIT) {
+		return WalkIteratively(root, enter, visit);
+	}
+
+	size_t subtree_depth = 0;
+	for (size_t i = 0; i < count; i++) {
+		Expression<Number>** operand = root->GetOperand(i);
+		if (enter(*operand)) {
+			subtree_depth = std::max(subtree_depth, WalkPostOrder(*operand, enter, visit, depth + 1));
+		}
+	}
+	visit(root);
+	return subtree_depth + 1;
+}
+
+template <typename Number, typename Visit>
+size_t WalkPostOrder(Expression<Number>*& root, Visit& visit) {
+	EnterAll enter;
+	return WalkPostOrder(root, enter, visit);
+}
+
+// A node of the syntax tree. Nodes live in the parser's arena, so they stay
+// trivially destructible and never own their children. Each one implements only
+// its own operation, the base class walks the tree and variables read their
+// slot from the array passed to Evaluate()
+template <typename Number = float>
+class Expression {
+public:
+	// Value of this node given the values of its operands
+	virtual Number Apply(const Number* operands, const Number* slots) const = 0;
+
+	// Appends the instruction of this node, its operands have already been emitted
+	virtual void Emit(Program<Number>& program) const = 0;
+
+	// Folds or removes this node once its operands are simplified. Returns the
+	// node that replaces this one, which is one of its operands or a new node
+	virtual Expression* SimplifyNode(Arena&) {
+		return this;
+	}
+
+	size_t GetOperandCount() const {
+		return operand_count;
+	}
+
+	// The instruction this node compiles to, which tells the kinds of nodes apart
+	OpCode GetOpCode() const {
+		return op;
+	}
+
+	// The parent's link to an operand, which Simplify() may replace
+	Expression** GetOperand(size_t index) {
+		return links + index;
+	}
+
+	const Expression* GetOperand(size_t index) const {
+		return links[index];
+	}
+
+	virtual bool IsConstant() const {
+		return false;
+	}
+
+	// Constants are folded bottom up, so a constant node is always a leaf. 0 and
+	// -0 are different constants
+	bool IsConstant(Number value) const {
+		return IsConstant() && NumberTraits<Number>::Equal(Apply(nullptr, nullptr), value);
+	}
+
+	// A shared node is computed where it is first reached and its value is reused
+	// by its other parents. The value is kept in the node, so a tree is evaluated
+	// by one caller at a time
+	Number Evaluate(const Number* slots) const {
+		return CanonicalNaN(EvaluateRecursively(slots, NextWalk(2), 0));
+	}
+
+	// The parser builds equal subtrees only once, so a node can have several
+	// parents. Such a node is computed where it is first used and saved in a
+	// temporary that its other uses recall
+	void Compile(Program<Number>& program) const {
+		Expression* root = const_cast<Expression*>(this);
+		CountUses(root);
+
+		uint64_t emitting = NextWalk();
+		auto recall = [&](Expression* node) {
+			if (node->walk == emitting) {
+				program.Emit(Instruction<Number>(OpCode::RECALL, node->temporary));
+				return false;
+			}
+			return true;
+		};
+		auto emit = [&](Expression* node) {
+			node->Emit(program);
+			// Leaves are cheaper to emit again than to recall
+			if (node->uses > 1 && node->GetOperandCount() != 0) {
+				node->walk = emitting;
+				node->temporary = program.AddTemporary();
+				program.Emit(Instruction<Number>(OpCode::STORE, node->temporary));
+			}
+		};
+		WalkPostOrder(root, recall, emit);
+	}
+
+	// Folds constant subtrees and removes identity operations below and including
+	// this node. A shared node is simplified once and its other parents are linked
+	// to the same replacement. Returns the node that replaces this one and adds
+	// the number of nodes the tree lost to removed: a replaced node takes over
+	// the links to the node it replaces, and a node is dropped once the last of
+	// its links is gone
+	Expression* Simplify(Arena& arena, size_t& removed) {
+		Expression* root = this;
+		CountUses(root);
+		// Replacements of the nodes with operands, in the order they were simplified
+		thread_local std::vector<Expression*> replacements;
+		replacements.clear();
+		uint64_t simplifying = NextWalk();
+		auto replace = [&](Expression*& node) {
+			if (node->walk == simplifying) {
+				node = replacements[node->temporary];
+				return false;
+			}
+			return true;
+		};
+		auto simplify = [&](Expression*& node) {
+			Expression* original = node;
+			node = node->SimplifyNode(arena);
+			if (node != original) {
+				// A new node was not in the tree before
+				size_t added = node->uses == 0 ? 1 : 0;
+				node->uses += original->uses;
+				removed += Release(original) - added;
+			}
+			if (original->GetOperandCount() != 0) {
+				original->walk = simplifying;
+				original->temporary = static_cast<uint32_t>(replacements.size());
+				replacements.push_back(node);
+			}
+		};
+		WalkPostOrder(root, replace, simplify);
+		return root;
+	}
+
+	// Number of nodes on the longest path from this node to a leaf
+	size_t GetDepth() const {
+		Expression* root = const_cast<Expression*>(this);
+		auto ignore = [](Expression*) {};
+		return WalkPostOrder(root, ignore);
+	}
+
+protected:
+	static constexpr size_t MAX_OPERANDS = 2;
+
+	// Nodes with operands keep them in an array of their own, nodes are walked
+	// through it without a virtual call per operand
+	Expression(OpCode op, Expression** links, uint8_t operand_count)
+		: links(links), op(op), operand_count(operand_count), walk(0), uses(0), temporary(0), evaluated(0), size(0),
+		  cached() {
+	}
+
+private:
+	template <typename>
+	friend class ParallelEvaluator;
+
+	Expression** links;
+	OpCode op;
+	uint8_t operand_count;
+	// Compile() state: the last walk that reached the node, the number of links
+	// to it and the temporary that holds its value. Simplify() keeps the index of
+	// the replacement in temporary
+	uint64_t walk;
+	uint32_t uses;
+	uint32_t temporary;
+	// Evaluate() state: the evaluation whose value is cached, see Remember()
+	uint64_t evaluated;
+	// ParallelEvaluator's count of the nodes below this one
+	uint32_t size;
+	Number cached;
+
+private:
+	// Walks that mark nodes get a number of their own, so marks never need to be
+	// cleared. The numbers have 64 bits and never wrap, so a mark left on a live
+	// tree cannot match a later walk. Each thread takes a block of numbers from a
+	// counter shared by all threads, so marks of different threads never match
+	// and walks do not contend on it. Zero is never used as nodes start out with
+	// it. A walk that needs several marks gets consecutive numbers
+	static uint64_t NextWalk(uint64_t marks = 1) {
+		constexpr uint64_t BLOCK = 1 << 16;
+		static std::atomic<uint64_t> blocks{1};
+		thread_local uint64_t next = 0;
+		thread_local uint64_t end = 0;
+		if (end - next < marks) {
+			next = blocks.fetch_add(BLOCK, std::memory_order_relaxed);
+			end = next + BLOCK;
+		}
+		uint64_t first = next;
+		next += marks;
+		return first;
+	}
+
+	// Counts the links to every node in uses, the root's own counts once. A
+	// shared subtree is walked only once
+	static void CountUses(Expression* root) {
+		uint64_t counting = NextWalk();
+		root->walk = counting;
+		root->uses = 1;
+		auto count = [&](Expression* node) {
+			if (node->walk == counting) {
+				node->uses++;
+				return false;
+			}
+			node->walk = counting;
+			node->uses = 1;
+			return true;
+		};
+		auto ignore = [](Expression*) {};
+		WalkPostOrder(root, count, ignore);
+	}
+
+	// Drops a node that lost all of its links, and with it every operand whose
+	// last link it held. Returns the number of nodes dropped
+	static size_t Release(Expression* node) {
+		thread_local std::vector<Expression*> pending;
+		pending.clear();
+		pending.push_back(node);
+		node->uses = 0;
+		size_t dropped = 0;
+		while (!pending.empty()) {
+			Expression* dropping = pending.back();
+			pending.pop_back();
+			dropped++;
+			for (size_t i = 0; i < dropping->GetOperandCount(); i++) {
+				Expression* operand = *dropping->GetOperand(i);
+				if (--operand->uses == 0) {
+					pending.push_back(operand);
+				}
+			}
+		}
+		return dropped;
+	}
+
+	// An evaluation uses two marks: evaluation while a node's value is being
+	// stored and evaluation + 1 once it is. The threads of a ParallelEvaluator
+	// may reach a shared node at the same time, the first to finish stores it
+	bool Recall(uint64_t evaluation, Number& value) const {
+		if (__atomic_load_n(&evaluated, __ATOMIC_ACQUIRE) != evaluation + 1) {
+			return false;
+		}
+		value = cached;
+		return true;
+	}
+
+	// Leaves are cheaper to apply again than to recall
+	void Remember(uint64_t evaluation, Number value) const {
+		Expression* node = const_cast<Expression*>(this);
+		uint64_t mark = __atomic_load_n(&node->evaluated, __ATOMIC_RELAXED);
+		if (operand_count == 0 || mark == evaluation || mark == evaluation + 1) {
+			return;
+		}
+		if (__atomic_compare_exchange_n(&node->evaluated, &mark, evaluation, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			node->cached = value;
+			__atomic_store_n(&node->evaluated, evaluation + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	// Recursive like WalkPostOrder(), but the operand values are passed in
+	// registers rather than on a stack
+	Number EvaluateRecursively(const Number* slots, uint64_t evaluation, size_t depth) const {
+		size_t count = GetOperandCount();
+		if (count == 0) {
+			return Apply(nullptr, slots);
+		}
+		Number value;
+		if (Recall(evaluation, value)) {
+			return value;
+		}
+		if (depth == RECURSION_LIMIT) {
+			return EvaluateIteratively(slots, evaluation);
+		}
+
+		Number operands[MAX_OPERANDS];
+		for (size_t i = 0; i < count; i++) {
+			operands[i] = GetOperand(i)->EvaluateRecursively(slots, evaluation, depth + 1);
+		}
+		value = Apply(operands, slots);
+		Remember(evaluation, value);
+		return value;
+	}
+
+	Number EvaluateIteratively(const Number* slots, uint64_t evaluation) const {
+		thread_local std::vector<Number> values;
+		values.clear();
+		Expression* root = const_cast<Expression*>(this);
+		auto recall = [&](Expression* node) {
+			Number value;
+			if (node->Recall(evaluation, value)) {
+				values.push_back(value);
+				return false;
+			}
+			return true;
+		};
+		auto evaluate = [&](Expression* node) {
+			size_t count = node->GetOperandCount();
+			Number value = node->Apply(values.data() + values.size() - count, slots);
+			values.resize(values.size() - count);
+			values.push_back(value);
+			node->Remember(evaluation, value);
+		};
+		WalkIteratively(root, recall, evaluate);
+		return values.back();
+	}
+};
+
+template <typename Number = float>
+class LiteralExpression : public Expression<Number> {
+public:
+	LiteralExpression(Number value) : Expression<Number>(OpCode::PUSH, nullptr, 0), value(value) {
+	}
+
+	Number Apply(const Number*, const Number*) const override {
+		return value;
+	}
+
+	void Emit(Program<Number>& program) const override {
+		program.Emit(Instruction<Number>(value));
+	}
+
+	bool IsConstant() const override {
+		return true;
+	}
+
+	Number value;
+};
+
+template <typename Number = float>
+class VariableExpression : public Expression<Number> {
+public:
+	VariableExpression(uint32_t slot) : Expression<Number>(OpCode::LOAD, nullptr, 0), slot(slot) {
+	}
+
+	Number Apply(const Number*, const Number* slots) const override {
+		return slots[slot];
+	}
+
+	void Emit(Program<Number>& program) const override {
+		program.Emit(Instruction<Number>(OpCode::LOAD, slot));
+	}
+
+	uint32_t slot;
+};
+
+template <typename Number = float>
+class BinaryExpression : public Expression<Number> {
+public:
+	BinaryExpression(OpCode op, Expression<Number>* lhs, Expression<Number>* rhs) : Expression<Number>(op, operands, 2), operands{lhs, rhs} {
+	}
+
+	void Emit(Program<Number>& program) const override {
+		program.Emit(Instruction<Number>(this->GetOpCode()));
+	}
+
+	// Folding here gives exactly the result the program would compute at run
+	// time, as both use the same arithmetic. A NaN is folded to the one every
+	// evaluator returns, so program listings and images show it too
+	Expression<Number>* SimplifyNode(Arena& arena) override {
+		if (operands[0]->IsConstant() && operands[1]->IsConstant()) {
+			Number values[2] = {operands[0]->Apply(nullptr, nullptr), operands[1]->Apply(nullptr, nullptr)};
+			return arena.Create<LiteralExpression<Number>>(CanonicalNaN(this->Apply(values, nullptr)));
+		}
+
+		return RemoveIdentity();
+	}
+
+	// Returns the operand that is left when the other one is an identity element
+	// for this operation. Only exact identities are removed, the result must keep
+	// the sign of a zero x
+	virtual Expression<Number>* RemoveIdentity() {
+		return this;
+	}
+
+	// Left and right hand side
+	Expression<Number>* operands[2];
+};
+
+template <typename Number = float>
+class AddExpression : public BinaryExpression<Number> {
+public:
+	AddExpression(Expression<Number>* lhs, Expression<Number>* rhs) : BinaryExpression<Number>(OpCode::ADD, lhs, rhs) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::ADD>::Apply(operands[0], operands[1]);
+	}
+
+	// x + -0 is x for every x, but 0 + -0 is 0, so x + 0 and 0 + x are kept
+	Expression<Number>* RemoveIdentity() override {
+		if (this->operands[1]->IsConstant(-Number(0))) {
+			return this->operands[0];
+		}
+		return this;
+	}
+};
+
+template <typename Number = float>
+class SubtractExpression : public BinaryExpression<Number> {
+public:
+	SubtractExpression(Expression<Number>* lhs, Expression<Number>* rhs) : BinaryExpression<Number>(OpCode::SUB, lhs, rhs) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::SUB>::Apply(operands[0], operands[1]);
+	}
+
+	// x - 0 is x for every x, but -0 - -0 is 0, so x - -0 is kept
+	Expression<Number>* RemoveIdentity() override {
+		if (this->operands[1]->IsConstant(Number(0))) {
+			return this->operands[0];
+		}
+		return this;
+	}
+};
+
+template <typename Number = float>
+class MultiplyExpression : public BinaryExpression<Number> {
+public:
+	MultiplyExpression(Expression<Number>* lhs, Expression<Number>* rhs) : BinaryExpression<Number>(OpCode::MUL, lhs, rhs) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::MUL>::Apply(operands[0], operands[1]);
+	}
+
+	Expression<Number>* RemoveIdentity() override {
+		if (this->operands[1]->IsConstant(1)) {
+			return this->operands[0];
+		}
+		if (this->operands[0]->IsConstant(1)) {
+			return this->operands[1];
+		}
+		return this;
+	}
+};
+
+template <typename Number = float>
+class DivideExpression : public BinaryExpression<Number> {
+public:
+	DivideExpression(Expression<Number>* lhs, Expression<Number>* rhs) : BinaryExpression<Number>(OpCode::DIV, lhs, rhs) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::DIV>::Apply(operands[0], operands[1]);
+	}
+
+	Expression<Number>* RemoveIdentity() override {
+		if (this->operands[1]->IsConstant(1)) {
+			return this->operands[0];
+		}
+		return this;
+	}
+};
+
+template <typename Number = float>
+class PowerExpression : public BinaryExpression<Number> {
+public:
+	PowerExpression(Expression<Number>* lhs, Expression<Number>* rhs) : BinaryExpression<Number>(OpCode::POW, lhs, rhs) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::POW>::Apply(operands[0], operands[1]);
+	}
+
+	// pow(x, 1) is exactly x, NaN included
+	Expression<Number>* RemoveIdentity() override {
+		if (this->operands[1]->IsConstant(1)) {
+			return this->operands[0];
+		}
+		return this;
+	}
+};
+
+template <typename Number = float>
+class ModuloExpression : public BinaryExpression<Number> {
+public:
+	ModuloExpression(Expression<Number>* lhs, Expression<Number>* rhs) : BinaryExpression<Number>(OpCode::MOD, lhs, rhs) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::MOD>::Apply(operands[0], operands[1]);
+	}
+};
+
+template <typename Number = float>
+class MinimumExpression : public BinaryExpression<Number> {
+public:
+	MinimumExpression(Expression<Number>* lhs, Expression<Number>* rhs) : BinaryExpression<Number>(OpCode::MIN, lhs, rhs) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::MIN>::Apply(operands[0], operands[1]);
+	}
+};
+
+template <typename Number = float>
+class MaximumExpression : public BinaryExpression<Number> {
+public:
+	MaximumExpression(Expression<Number>* lhs, Expression<Number>* rhs) : BinaryExpression<Number>(OpCode::MAX, lhs, rhs) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::MAX>::Apply(operands[0], operands[1]);
+	}
+};
+
+// Unary minus and the functions of one argument
+template <typename Number = float>
+class UnaryExpression : public Expression<Number> {
+public:
+	UnaryExpression(OpCode op, Expression<Number>* operand) : Expression<Number>(op, operands, 1), operands{operand} {
+	}
+
+	void Emit(Program<Number>& program) const override {
+		program.Emit(Instruction<Number>(this->GetOpCode()));
+	}
+
+	Expression<Number>* SimplifyNode(Arena& arena) override {
+		if (operands[0]->IsConstant()) {
+			Number value = operands[0]->Apply(nullptr, nullptr);
+			return arena.Create<LiteralExpression<Number>>(CanonicalNaN(this->Apply(&value, nullptr)));
+		}
+		return this;
+	}
+
+	Expression<Number>* operands[1];
+};
+
+template <typename Number = float>
+class NegateExpression : public UnaryExpression<Number> {
+public:
+	NegateExpression(Expression<Number>* operand) : UnaryExpression<Number>(OpCode::NEG, operand) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::NEG>::Apply(operands[0]);
+	}
+};
+
+template <typename Number = float>
+class SquareRootExpression : public UnaryExpression<Number> {
+public:
+	SquareRootExpression(Expression<Number>* operand) : UnaryExpression<Number>(OpCode::SQRT, operand) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::SQRT>::Apply(operands[0]);
+	}
+};
+
+template <typename Number = float>
+class ExponentialExpression : public UnaryExpression<Number> {
+public:
+	ExponentialExpression(Expression<Number>* operand) : UnaryExpression<Number>(OpCode::EXP, operand) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::EXP>::Apply(operands[0]);
+	}
+};
+
+template <typename Number = float>
+class LogarithmExpression : public UnaryExpression<Number> {
+public:
+	LogarithmExpression(Expression<Number>* operand) : UnaryExpression<Number>(OpCode::LOG, operand) {
+	}
+
+	Number Apply(const Number* operands, const Number*) const override {
+		return Operation<OpCode::LOG>::Apply(operands[0]);
+	}
+};
+
+// Maps variable names to the slots they are read from at evaluation time. Names
+// are only looked up while parsing, compiled code refers to slots directly
+class SymbolTable {
+public:
+	SymbolTable() = default;
+	SymbolTable(const SymbolTable&) = delete;
+	SymbolTable& operator=(const SymbolTable&) = delete;
+
+	// Returns the slot of the variable, adding it if it is not declared yet
+	uint32_t Declare(std::string_view name) {
+		auto it = slots.find(name);
+		if (it != slots.end()) {
+			return it->second;
+		}
+		uint32_t slot = static_cast<uint32_t>(slots.size());
+		names.emplace_back(name);
+		slots.emplace(names.back(), slot);
+		return slot;
+	}
+
+	// Looking up a name does not allocate
+	bool Find(std::string_view name, uint32_t& slot) const {
+		auto it = slots.find(name);
+		if (it == slots.end()) {
+			return false;
+		}
+		slot = it->second;
+		return true;
+	}
+
+	// Number of slots an array passed to Evaluate() or Execute() must have
+	size_t GetSize() const {
+		return slots.size();
+	}
+
+	std::string_view GetName(uint32_t slot) const {
+		return names[slot];
+	}
+
+private:
+	// The keys of slots point into names, whose elements never move
+	std::deque<std::string> names;
+	std::unordered_map<std::string_view, uint32_t> slots;
+};
+
+// Token source over the buffer filled by Lexer::Scan()
+template <typename Number = float>
+class TokenVector {
+public:
+	TokenVector(const TokenBuffer<Number>& tokens) : index(0), literal_index(0), name_index(0), tokens(tokens) {
+	}
+
+	bool IsAtEnd() const {
+		return index == tokens.GetSize();
+	}
+
+	Token<Number> Peek() const {
+		TokenType type = tokens.GetType(index);
+		if (type == TokenType::LITERAL) {
+			return Token<Number>(tokens.GetLiteral(literal_index));
+		} else if (type == TokenType::IDENTIFIER) {
+			return Token<Number>(tokens.GetName(name_index));
+		}
+		return Token<Number>(type);
+	}
+
+	size_t GetPosition() const {
+		return tokens.GetPosition(index);
+	}
+
+	void Advance() {
+		TokenType type = tokens.GetType(index);
+		if (type == TokenType::LITERAL) {
+			literal_index++;
+		} else if (type == TokenType::IDENTIFIER) {
+			name_index++;
+		}
+		index++;
+	}
+
+	// Any invalid character was already reported by Lexer::Scan()
+	Error Finish() {
+		return Error(Error::Type::NO_ERROR, 0, std::string_view());
+	}
+
+private:
+	size_t index;
+	size_t literal_index;
+	size_t name_index;
+	const TokenBuffer<Number>& tokens;
+};
+
+// Token source that lexes one token ahead of the parser, so no token vectors are
+// ever built
+template <typename Number = float>
+class TokenStream {
+public:
+	TokenStream(Lexer<Number>& lexer)
+		: lexer(lexer), current(TokenType::ADD), current_position(0), at_end(false), error(Error::Type::NO_ERROR, 0, std::string_view()) {
+		Advance();
+	}
+
+	bool IsAtEnd() const {
+		return at_end;
+	}
+
+	const Token<Number>& Peek() const {
+		return current;
+	}
+
+	size_t GetPosition() const {
+		return current_position;
+	}
+
+	void Advance() {
+		at_end = !lexer.Next(current, current_position, error);
+	}
+
+	// Lexes whatever the parser did not consume and returns the first invalid
+	// character, so errors are reported exactly as if the whole source had been
+	// scanned up front
+	Error Finish() {
+		while (!at_end) {
+			Advance();
+		}
+		return error;
+	}
+
+private:
+	Lexer<Number>& lexer;
+	Token<Number> current;
+	size_t current_position;
+	bool at_end;
+	Error error;
+};
+
+// Parentheses nested deeper than this are rejected by default, 0 disables the limit
+constexpr size_t DEFAULT_MAX_DEPTH = 10000;
+
+// What a node computes: its operation and either its literal, its variable or
+// the nodes of its operands. Operands are looked up before the nodes that use
+// them, so equal subtrees are always the same node and comparing operand
+// pointers is enough to compare whole subtrees
+template <typename Number>
+struct NodeKey {
+	static NodeKey Literal(Number value) {
+		NodeKey key(OpCode::PUSH);
+		key.value = value;
+		return key;
+	}
+
+	static NodeKey Variable(uint32_t slot) {
+		NodeKey key(OpCode::LOAD);
+		key.slot = slot;
+		return key;
+	}
+
+	// A unary operator has no rhs
+	static NodeKey Operator(OpCode op, const Expression<Number>* lhs, const Expression<Number>* rhs = nullptr) {
+		NodeKey key(op);
+		key.lhs = lhs;
+		key.rhs = rhs;
+		return key;
+	}
+
+	size_t Hash() const {
+		uint64_t hash = static_cast<uint64_t>(op);
+		if (op == OpCode::PUSH) {
+			hash = Mix(hash, NumberTraits<Number>::Hash(value));
+		} else if (op == OpCode::LOAD) {
+			hash = Mix(hash, slot);
+		} else {
+			hash = Mix(Mix(hash, reinterpret_cast<uintptr_t>(lhs)), reinterpret_cast<uintptr_t>(rhs));
+		}
+		return static_cast<size_t>(hash ^ hash >> 32);
+	}
+
+	// Whether node computes what this key describes
+	bool Matches(const Expression<Number>* node) const {
+		if (node->GetOpCode() != op) {
+			return false;
+		} else if (op == OpCode::PUSH) {
+			return NumberTraits<Number>::Equal(static_cast<const LiteralExpression<Number>*>(node)->value, value);
+		} else if (op == OpCode::LOAD) {
+			return static_cast<const VariableExpression<Number>*>(node)->slot == slot;
+		}
+		return node->GetOperand(0) == lhs && (GetArity(op) == 1 || node->GetOperand(1) == rhs);
+	}
+
+	OpCode op;
+	Number value;
+	uint32_t slot;
+	const Expression<Number>* lhs;
+	const Expression<Number>* rhs;
+
+private:
+	NodeKey(OpCode op) : op(op), value(0), slot(0), lhs(nullptr), rhs(nullptr) {
+	}
+
+	static uint64_t Mix(uint64_t hash, uint64_t value) {
+		return (hash ^ value) * 0x9E3779B97F4A7C15;
+	}
+};
+
+// Open addressing hash table of the nodes a parser has built, so every distinct
+// subexpression is built once and the AST becomes a DAG. The table is only
+// needed while parsing, so rather than in the arena next to the nodes its
+// entries live in storage reused by every parse on the thread. Only one table
+// may be in use on a thread at a time
+template <typename Number>
+class NodeTable {
+public:
+	NodeTable() : capacity(INITIAL_CAPACITY), size(0) {
+		Storage& storage = GetStorage();
+		generation = storage.NextGeneration();
+		entries = storage.Get(current = 0, capacity);
+	}
+
+	NodeTable(const NodeTable&) = delete;
+	NodeTable& operator=(const NodeTable&) = delete;
+
+	// Returns the table's link to the node for key, which is nullptr if no such
+	// node has been built yet and must then be set by the caller
+	Expression<Number>*& Find(const NodeKey<Number>& key) {
+		// Kept at most half full so probe sequences stay short
+		if (size * 2 >= capacity) {
+			Grow();
+		}
+		uint32_t hash = static_cast<uint32_t>(key.Hash());
+		size_t mask = capacity - 1;
+		for (size_t index = hash & mask;; index = (index + 1) & mask) {
+			Entry& entry = entries[index];
+			if (entry.generation != generation) {
+				entry.hash = hash;
+				entry.generation = generation;
+				entry.node = nullptr;
+				size++;
+				return entry.node;
+			}
+			if (entry.hash == hash && key.Matches(entry.node)) {
+				return entry.node;
+			}
+		}
+	}
+
+private:
+	// Entries are never cleared, so starting large costs nothing and most
+	// expressions never need to grow the table
+	static constexpr size_t INITIAL_CAPACITY = 1024;
+
+	// Entries of older generations are empty, so a new table needs no clearing.
+	// Nodes are compared through the node itself, so entries stay small
+	struct Entry {
+		uint32_t hash;
+		uint32_t generation;
+		Expression<Number>* node;
+	};
+
+	// Growing rehashes the entries from one buffer into the other
+	struct Storage {
+		std::vector<Entry> buffers[2];
+		uint32_t generation = 0;
+
+		uint32_t NextGeneration() {
+			if (++generation == 0) {
+				// Entries from before the counter wrapped could match again
+				for (std::vector<Entry>& buffer : buffers) {
+					for (Entry& entry : buffer) {
+						entry.generation = 0;
+					}
+				}
+				generation = 1;
+			}
+			return generation;
+		}
+
+		Entry* Get(size_t buffer, size_t count) {
+			if (buffers[buffer].size() < count) {
+				buffers[buffer].resize(count, Entry{0, 0, nullptr});
+			}
+			return buffers[buffer].data();
+		}
+	};
+
+	Entry* entries;
+	size_t capacity;
+	size_t size;
+	size_t current;
+	uint32_t generation;
+
+private:
+	static Storage& GetStorage() {
+		thread_local Storage storage;
+		return storage;
+	}
+
+	void Grow() {
+		Storage& storage = GetStorage();
+		// The other buffer may hold entries this table left there earlier, moving
+		// to a new generation empties it
+		uint32_t grown_generation = storage.NextGeneration();
+		current = 1 - current;
+		Entry* grown = storage.Get(current, capacity * 2);
+		size_t mask = capacity * 2 - 1;
+		for (size_t i = 0; i < capacity; i++) {
+			if (entries[i].generation == generation) {
+				size_t index = entries[i].hash & mask;
+				while (grown[index].generation == grown_generation) {
+					index = (index + 1) & mask;
+				}
+				grown[index] = entries[i];
+				grown[index].generation = grown_generation;
+			}
+		}
+		entries = grown;
+		capacity *= 2;
+		generation = grown_generation;
+	}
+};
+
+// Precedence of the operators, higher binds tighter. Unary minus binds tighter
+// than every binary operator but "^", so -x^2 is -(x^2) and -x*y is (-x)*y
+constexpr int GetPrecedence(OpCode op) {
+	switch (op) {
+	case OpCode::POW:
+		return 4;
+	case OpCode::NEG:
+		return 3;
+	case OpCode::MUL:
+	case OpCode::DIV:
+	case OpCode::MOD:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+// Whether a pending operator is reduced before next is pushed. "^" is right
+// associative, the other binary operators are left associative
+constexpr bool ReducesBefore(OpCode pending, OpCode next) {
+	return GetPrecedence(pending) > GetPrecedence(next) || (GetPrecedence(pending) == GetPrecedence(next) && next != OpCode::POW);
+}
+
+// Returns false for tokens that are not binary operators
+constexpr bool GetBinaryOperator(TokenType type, OpCode& op) {
+	switch (type) {
+	case TokenType::ADD:
+		op = OpCode::ADD;
+		return true;
+	case TokenType::SUB:
+		op = OpCode::SUB;
+		return true;
+	case TokenType::MUL:
+		op = OpCode::MUL;
+		return true;
+	case TokenType::DIV:
+		op = OpCode::DIV;
+		return true;
+	case TokenType::POW:
+		op = OpCode::POW;
+		return true;
+	case TokenType::MOD:
+		op = OpCode::MOD;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// A name followed by a parenthesis is a call, of one of these functions
+constexpr bool FindFunction(std::string_view name, OpCode& op) {
+	if (name == "sqrt") {
+		op = OpCode::SQRT;
+	} else if (name == "exp") {
+		op = OpCode::EXP;
+	} else if (name == "log") {
+		op = OpCode::LOG;
+	} else if (name == "min") {
+		op = OpCode::MIN;
+	} else if (name == "max") {
+		op = OpCode::MAX;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// An operator waiting for its operands, or an open parenthesis. The
+// parenthesis of a function call holds the function and counts the arguments
+// read so far
+struct PendingOperator {
+	enum class Kind : uint8_t { OPERATOR, PARENTHESIS, CALL };
+
+	Kind kind;
+	OpCode op;
+	uint8_t arguments;
+};
+
+// Operator precedence parser for the grammar in grammar.txt. Pending operators
+// and operands are kept on explicit stacks in the arena rather than on the native
+// stack, so deeply nested input cannot overflow it. Syntax errors stop the parse
+// with nullptr, the first error is kept in the parser. Nodes built before the
+// error stay in the arena and are released with it. Equal subexpressions share
+// one node, see NodeTable
+template <typename Number, typename TokenSource>
+class BasicParser {
+public:
+	// Nodes are created in the given arena if there is one, it must then outlive
+	// the AST, and in an arena owned by the parser otherwise
+	BasicParser(TokenSource tokens, std::string_view source, const SymbolTable& symbols, size_t max_depth, Arena* arena)
+		: tokens(tokens), source(source), symbols(symbols), max_depth(max_depth), arena(arena != nullptr ? *arena : own_arena), expr(nullptr),
+		  error(Error::Type::NO_ERROR, 0, source) {
+	}
+
+	Error Parse() {
+		expr = ParseExpression();
+		Error result = error;
+		if (expr != nullptr && !tokens.IsAtEnd()) {
+			result = Error(Error::Type::INVALID_TOKEN, tokens.GetPosition(), source);
+		}
+
+		// Invalid characters take precedence over syntax errors
+		Error lex_error = tokens.Finish();
+		if (lex_error) {
+			expr = nullptr;
+			return lex_error;
+		}
+		return result;
+	}
+
+	// Simplifies the parsed AST in place, returns the number of nodes removed
+	size_t Optimize() {
+		size_t removed = 0;
+		expr = expr->Simplify(arena, removed);
+		return removed;
+	}
+
+	// The AST lives in the parser's arena and is only valid as long as it is
+	const Expression<Number>* GetAST() {
+		return expr;
+	}
+
+private:
+	TokenSource tokens;
+	std::string_view source;
+	const SymbolTable& symbols;
+	size_t max_depth;
+	Arena own_arena;
+	Arena& arena;
+	Expression<Number>* expr;
+	Error error;
+
+private:
+	template <typename... Args>
+	bool Match(TokenType first, Args... args) {
+		return Check(first) || Match(args...);
+	}
+
+	bool Match(TokenType first) {
+		return Check(first);
+	}
+
+	bool Check(TokenType type) {
+		if (IsAtEnd())
+			return false;
+
+		return tokens.Peek().token_type == type;
+	}
+
+	bool IsAtEnd() {
+		return tokens.IsAtEnd();
+	}
+
+	// Records an error at the current token and returns nullptr to unwind
+	Expression<Number>* Fail(Error::Type type) {
+		if (type == Error::Type::INVALID_TOKEN && IsAtEnd()) {
+			error = Error(Error::Type::END_OF_STREAM, source.size(), source);
+		} else {
+			error = Error(type, tokens.GetPosition(), source);
+		}
+		return nullptr;
+	}
+
+	Expression<Number>* Fail(Error::Type type, size_t position) {
+		error = Error(type, position, source);
+		return nullptr;
+	}
+
+	bool Consume(TokenType type) {
+		if (!Check(type)) {
+			Fail(Error::Type::INVALID_TOKEN);
+			return false;
+		}
+		tokens.Advance();
+		return true;
+	}
+
+	// Returns the node for key, building it from args if there is none yet
+	template <typename Node, typename... Args>
+	Expression<Number>* Intern(NodeTable<Number>& nodes, const NodeKey<Number>& key, Args... args) {
+		Expression<Number>*& node = nodes.Find(key);
+		if (node == nullptr) {
+			node = arena.Create<Node>(args...);
+		}
+		return node;
+	}
+
+	template <typename Node>
+	Expression<Number>* InternUnary(NodeTable<Number>& nodes, OpCode op, Expression<Number>* operand) {
+		return Intern<Node>(nodes, NodeKey<Number>::Operator(op, operand), operand);
+	}
+
+	template <typename Node>
+	Expression<Number>* InternBinary(NodeTable<Number>& nodes, OpCode op, Expression<Number>* lhs, Expression<Number>* rhs) {
+		return Intern<Node>(nodes, NodeKey<Number>::Operator(op, lhs, rhs), lhs, rhs);
+	}
+
+	// Replaces the operands of an operator or function on top of the stack with
+	// its node
+	void Reduce(OpCode op, ArenaStack<Expression<Number>*>& operands, NodeTable<Number>& nodes) {
+		if (GetArity(op) == 1) {
+			Expression<Number>* operand = operands.Pop();
+			if (op == OpCode::NEG) {
+				operands.Push(InternUnary<NegateExpression<Number>>(nodes, op, operand));
+			} else if (op == OpCode::SQRT) {
+				operands.Push(InternUnary<SquareRootExpression<Number>>(nodes, op, operand));
+			} else if (op == OpCode::EXP) {
+				operands.Push(InternUnary<ExponentialExpression<Number>>(nodes, op, operand));
+			} else {
+				operands.Push(InternUnary<LogarithmExpression<Number>>(nodes, op, operand));
+			}
+			return;
+		}
+
+		Expression<Number>* rhs = operands.Pop();
+		Expression<Number>* lhs = operands.Pop();
+		if (op == OpCode::ADD) {
+			operands.Push(InternBinary<AddExpression<Number>>(nodes, op, lhs, rhs));
+		} else if (op == OpCode::SUB) {
+			operands.Push(InternBinary<SubtractExpression<Number>>(nodes, op, lhs, rhs));
+		} else if (op == OpCode::MUL) {
+			operands.Push(InternBinary<MultiplyExpression<Number>>(nodes, op, lhs, rhs));
+		} else if (op == OpCode::DIV) {
+			operands.Push(InternBinary<DivideExpression<Number>>(nodes, op, lhs, rhs));
+		} else if (op == OpCode::POW) {
+			operands.Push(InternBinary<PowerExpression<Number>>(nodes, op, lhs, rhs));
+		} else if (op == OpCode::MOD) {
+			operands.Push(InternBinary<ModuloExpression<Number>>(nodes, op, lhs, rhs));
+		} else if (op == OpCode::MIN) {
+			operands.Push(InternBinary<MinimumExpression<Number>>(nodes, op, lhs, rhs));
+		} else {
+			operands.Push(InternBinary<MaximumExpression<Number>>(nodes, op, lhs, rhs));
+		}
+	}
+
+	bool MatchBinaryOperator(OpCode& op) {
+		return !IsAtEnd() && GetBinaryOperator(tokens.Peek().token_type, op);
+	}
+
+	bool IsOperatorOnTop(const ArenaStack<PendingOperator>& operators) const {
+		return !operators.IsEmpty() && operators.Top().kind == PendingOperator::Kind::OPERATOR;
+	}
+
+	// Alternates between reading an operand, with any unary minuses, parentheses
+	// and function calls opened before it, and reading the parentheses closed and
+	// arguments separated after it followed by a binary operator. Pending
+	// operators that ReducesBefore() the new one are reduced before it is pushed.
+	// Stops at the first token that cannot continue the expression, Parse()
+	// reports it if it is not the end
+	Expression<Number>* ParseExpression() {
+		ArenaStack<PendingOperator> operators(arena);
+		ArenaStack<Expression<Number>*> operands(arena);
+		NodeTable<Number> nodes;
+		size_t depth = 0;
+
+		while (true) {
+			Expression<Number>* operand = nullptr;
+			while (operand == nullptr) {
+				if (Match(TokenType::SUB)) {
+					operators.Push(PendingOperator{PendingOperator::Kind::OPERATOR, OpCode::NEG, 0});
+					tokens.Advance();
+				} else if (Match(TokenType::LEFT_PAREN)) {
+					if (max_depth != 0 && ++depth > max_depth) {
+						return Fail(Error::Type::TOO_DEEP);
+					}
+					operators.Push(PendingOperator{PendingOperator::Kind::PARENTHESIS, OpCode::PUSH, 0});
+					tokens.Advance();
+				} else if (Match(TokenType::IDENTIFIER)) {
+					std::string_view name = tokens.Peek().name;
+					size_t position = tokens.GetPosition();
+					tokens.Advance();
+					if (!Match(TokenType::LEFT_PAREN)) {
+						operand = Variable(nodes, name, position);
+						if (operand == nullptr) {
+							return nullptr;
+						}
+						continue;
+					}
+					OpCode function;
+					if (!FindFunction(name, function)) {
+						return Fail(Error::Type::UNKNOWN_FUNCTION, position);
+					}
+					if (max_depth != 0 && ++depth > max_depth) {
+						return Fail(Error::Type::TOO_DEEP);
+					}
+					operators.Push(PendingOperator{PendingOperator::Kind::CALL, function, 1});
+					tokens.Advance();
+				} else {
+					operand = Literal(nodes);
+					if (operand == nullptr) {
+						return nullptr;
+					}
+				}
+			}
+			operands.Push(operand);
+
+			OpCode op;
+			bool next_argument = false;
+			while (!next_argument && !MatchBinaryOperator(op)) {
+				while (IsOperatorOnTop(operators)) {
+					Reduce(operators.Pop().op, operands, nodes);
+				}
+				if (operators.IsEmpty()) {
+					return operands.Pop();
+				}
+				PendingOperator& group = operators.Top();
+				bool call = group.kind == PendingOperator::Kind::CALL;
+				if (call && group.arguments < GetArity(group.op)) {
+					if (!Consume(TokenType::COMMA)) {
+						return nullptr;
+					}
+					group.arguments++;
+					next_argument = true;
+					continue;
+				}
+				if (!Consume(TokenType::RIGHT_PAREN)) {
+					return nullptr;
+				}
+				PendingOperator closed = operators.Pop();
+				if (closed.kind == PendingOperator::Kind::CALL) {
+					Reduce(closed.op, operands, nodes);
+				}
+				depth--;
+			}
+			if (next_argument) {
+				continue;
+			}
+
+			while (IsOperatorOnTop(operators) && ReducesBefore(operators.Top().op, op)) {
+				Reduce(operators.Pop().op, operands, nodes);
+			}
+			operators.Push(PendingOperator{PendingOperator::Kind::OPERATOR, op, 0});
+			tokens.Advance();
+		}
+	}
+
+	// A variable, the identifier has already been read
+	Expression<Number>* Variable(NodeTable<Number>& nodes, std::string_view name, size_t position) {
+		uint32_t slot;
+		if (!symbols.Find(name, slot)) {
+			return Fail(Error::Type::UNKNOWN_VARIABLE, position);
+		}
+		return Intern<VariableExpression<Number>>(nodes, NodeKey<Number>::Variable(slot), slot);
+	}
+
+	// Names, parentheses and unary minus are handled by ParseExpression()
+	Expression<Number>* Literal(NodeTable<Number>& nodes) {
+		if (Match(TokenType::LITERAL)) {
+			Number value = tokens.Peek().literal_value;
+			tokens.Advance();
+			return Intern<LiteralExpression<Number>>(nodes, NodeKey<Number>::Literal(value), value);
+		}
+		return Fail(Error::Type::INVALID_TOKEN);
+	}
+};
+
+// Parses tokens that were scanned up front by Lexer::Scan()
+template <typename Number = float>
+class Parser : public BasicParser<Number, TokenVector<Number>> {
+public:
+	Parser(const TokenBuffer<Number>& tokens, std::string_view source, const SymbolTable& symbols, size_t max_depth = DEFAULT_MAX_DEPTH,
+		   Arena* arena = nullptr)
+		: BasicParser<Number, TokenVector<Number>>(TokenVector<Number>(tokens), source, symbols, max_depth, arena) {
+	}
+};
+
+// Pulls tokens from the lexer while parsing, in a single pass over the source
+template <typename Number = float>
+class StreamingParser : public BasicParser<Number, TokenStream<Number>> {
+public:
+	StreamingParser(Lexer<Number>& lexer, std::string_view source, const SymbolTable& symbols, size_t max_depth = DEFAULT_MAX_DEPTH,
+					Arena* arena = nullptr)
+		: BasicParser<Number, TokenStream<Number>>(TokenStream<Number>(lexer), source, symbols, max_depth, arena) {
+	}
+};
+
+// Evaluates an expression of literals while it is scanned and parsed, with no
+// allocation and no virtual calls, so it can run in a constant expression. Only
+// + - * /, unary minus, min() and max(), and exp() and log() of float and
+// double are constant on every compiler. "^", "%" and sqrt() need library calls
+// or builtins that GCC folds but other compilers may not. Tokens, operators and
+// operands live in fixed buffers of CAPACITY entries, a source of up to
+// CAPACITY characters always fits. The grammar and error precedence are the
+// same as Lexer and Parser, but there are no variables
+template <typename Number = float, size_t CAPACITY = 256>
+class ConstantEvaluator {
+public:
+	constexpr ConstantEvaluator(std::string_view source) : source(source) {
+	}
+
+	// Returns NO_ERROR and sets result, or the type of the first error, which is
+	// then at GetErrorPosition(). A division by zero or an overflow is not a
+	// constant expression, so in one it fails to compile
+	constexpr Error::Type Evaluate(Number& result) {
+		if (source.size() > CAPACITY) {
+			return Fail(Error::Type::TOO_LONG, CAPACITY);
+		}
+		if (Error::Type error = Scan(); error != Error::Type::NO_ERROR) {
+			return error;
+		}
+		return Parse(result);
+	}
+
+	constexpr size_t GetErrorPosition() const {
+		return error_position;
+	}
+
+private:
+	std::string_view source;
+	size_t error_position = 0;
+
+	std::array<TokenType, CAPACITY> types{};
+	std::array<uint32_t, CAPACITY> positions{};
+	// Indexed by token, unlike TokenBuffer
+	std::array<Number, CAPACITY> literals{};
+	size_t token_count = 0;
+	size_t current = 0;
+
+	std::array<PendingOperator, CAPACITY> operators{};
+	size_t operator_count = 0;
+	std::array<Number, CAPACITY> operands{};
+	size_t operand_count = 0;
+
+private:
+	static constexpr bool IsDigit(char ch) {
+		return ch >= '0' && ch <= '9';
+	}
+
+	static constexpr bool IsIdentifierChar(char ch) {
+		return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_' || IsDigit(ch);
+	}
+
+	// The characters std::isspace() accepts in the "C" locale
+	static constexpr bool IsWhiteSpace(char ch) {
+		return ch == ' ' || (ch >= '\t' && ch <= '\r');
+	}
+
+	constexpr Error::Type Fail(Error::Type type, size_t position) {
+		error_position = position;
+		return type;
+	}
+
+	constexpr void Push(TokenType type, size_t position) {
+		types[token_count] = type;
+		positions[token_count] = static_cast<uint32_t>(position);
+		token_count++;
+	}
+
+	// Lexes the whole source up front, like Lexer::Scan(), so invalid characters
+	// are reported before syntax errors
+	constexpr Error::Type Scan() {
+		size_t position = 0;
+		while (position < source.size()) {
+			char ch = source[position];
+			size_t start = position++;
+			if (IsWhiteSpace(ch)) {
+				continue;
+			} else if (ch == '+') {
+				Push(TokenType::ADD, start);
+			} else if (ch == '-') {
+				Push(TokenType::SUB, start);
+			} else if (ch == '*') {
+				Push(TokenType::MUL, start);
+			} else if (ch == '/') {
+				Push(TokenType::DIV, start);
+			} else if (ch == '^') {
+				Push(TokenType::POW, start);
+			} else if (ch == '%') {
+				Push(TokenType::MOD, start);
+			} else if (ch == ',') {
+				Push(TokenType::COMMA, start);
+			} else if (ch == '(') {
+				Push(TokenType::LEFT_PAREN, start);
+			} else if (ch == ')') {
+				Push(TokenType::RIGHT_PAREN, start);
+			} else if (IsIdentifierChar(ch) && !IsDigit(ch)) {
+				while (position < source.size() && IsIdentifierChar(source[position])) {
+					position++;
+				}
+				Push(TokenType::IDENTIFIER, start);
+			} else if (IsDigit(ch)) {
+				bool has_decimal_point = false;
+				while (position < source.size() && (IsDigit(source[position]) || (!has_decimal_point && source[position] == '.'))) {
+					has_decimal_point = has_decimal_point || source[position] == '.';
+					position++;
+				}
+				literals[token_count] = ParseLiteral(source.substr(start, position - start));
+				Push(TokenType::LITERAL, start);
+			} else {
+				return Fail(Error::Type::INVALID_CHAR, start);
+			}
+		}
+		return Error::Type::NO_ERROR;
+	}
+
+	// Literals that NumberTraits::ParseExact() converts match the runtime lexer,
+	// others are rounded through long double and can differ from it in the last
+	// bit. Digits after the first 19 significant ones are dropped
+	static constexpr Number ParseLiteral(std::string_view literal) {
+		Number exact = 0;
+		if (NumberTraits<Number>::ParseExact(literal.data(), literal.data() + literal.size(), exact)) {
+			return exact;
+		}
+		uint64_t digits = 0;
+		int exponent = 0;
+		ReadDecimal(literal.data(), literal.data() + literal.size(), digits, exponent);
+
+		// Overflow is not a constant expression, so the scaling stops at infinity
+		long double value = static_cast<long double>(digits);
+		for (; exponent > 0; exponent--) {
+			if (value > static_cast<long double>(std::numeric_limits<Number>::max()) / 10) {
+				return std::numeric_limits<Number>::infinity();
+			}
+			value *= 10;
+		}
+		for (; exponent < 0; exponent++) {
+			value /= 10;
+		}
+		return static_cast<Number>(value);
+	}
+
+	constexpr bool IsAtEnd() const {
+		return current == token_count;
+	}
+
+	constexpr bool Check(TokenType type) const {
+		return !IsAtEnd() && types[current] == type;
+	}
+
+	constexpr bool CheckBinaryOperator(OpCode& op) const {
+		return !IsAtEnd() && GetBinaryOperator(types[current], op);
+	}
+
+	constexpr Error::Type FailAtToken(Error::Type type) {
+		if (type == Error::Type::INVALID_TOKEN && IsAtEnd()) {
+			return Fail(Error::Type::END_OF_STREAM, source.size());
+		}
+		return Fail(type, positions[current]);
+	}
+
+	constexpr bool IsOperatorOnTop() const {
+		return operator_count != 0 && operators[operator_count - 1].kind == PendingOperator::Kind::OPERATOR;
+	}
+
+	constexpr void Reduce(OpCode op) {
+		if (GetArity(op) == 1) {
+			Number operand = operands[--operand_count];
+			if (op == OpCode::NEG) {
+				operands[operand_count++] = Operation<OpCode::NEG>::Apply(operand);
+			} else if (op == OpCode::SQRT) {
+				operands[operand_count++] = Operation<OpCode::SQRT>::Apply(operand);
+			} else if (op == OpCode::EXP) {
+				operands[operand_count++] = Operation<OpCode::EXP>::Apply(operand);
+			} else {
+				operands[operand_count++] = Operation<OpCode::LOG>::Apply(operand);
+			}
+			return;
+		}
+
+		Number rhs = operands[--operand_count];
+		Number lhs = operands[--operand_count];
+		if (op == OpCode::ADD) {
+			operands[operand_count++] = Operation<OpCode::ADD>::Apply(lhs, rhs);
+		} else if (op == OpCode::SUB) {
+			operands[operand_count++] = Operation<OpCode::SUB>::Apply(lhs, rhs);
+		} else if (op == OpCode::MUL) {
+			operands[operand_count++] = Operation<OpCode::MUL>::Apply(lhs, rhs);
+		} else if (op == OpCode::DIV) {
+			operands[operand_count++] = Operation<OpCode::DIV>::Apply(lhs, rhs);
+		} else if (op == OpCode::POW) {
+			operands[operand_count++] = Operation<OpCode::POW>::Apply(lhs, rhs);
+		} else if (op == OpCode::MOD) {
+			operands[operand_count++] = Operation<OpCode::MOD>::Apply(lhs, rhs);
+		} else if (op == OpCode::MIN) {
+			operands[operand_count++] = Operation<OpCode::MIN>::Apply(lhs, rhs);
+		} else {
+			operands[operand_count++] = Operation<OpCode::MAX>::Apply(lhs, rhs);
+		}
+	}
+
+	// The name of the identifier token at index
+	constexpr std::string_view GetName(size_t index) const {
+		size_t start = positions[index];
+		size_t end = start;
+		while (end < source.size() && IsIdentifierChar(source[end])) {
+			end++;
+		}
+		return source.substr(start, end - start);
+	}
+
+	// The same loop as BasicParser::ParseExpression(), reducing operators to
+	// values instead of nodes. Every stack entry comes from a distinct token, so
+	// the stacks cannot overflow
+	constexpr Error::Type Parse(Number& result) {
+		while (true) {
+			while (true) {
+				if (Check(TokenType::SUB)) {
+					operators[operator_count++] = PendingOperator{PendingOperator::Kind::OPERATOR, OpCode::NEG, 0};
+					current++;
+				} else if (Check(TokenType::LEFT_PAREN)) {
+					operators[operator_count++] = PendingOperator{PendingOperator::Kind::PARENTHESIS, OpCode::PUSH, 0};
+					current++;
+				} else if (Check(TokenType::IDENTIFIER) && current + 1 < token_count && types[current + 1] == TokenType::LEFT_PAREN) {
+					OpCode function = OpCode::PUSH;
+					if (!FindFunction(GetName(current), function)) {
+						return FailAtToken(Error::Type::UNKNOWN_FUNCTION);
+					}
+					operators[operator_count++] = PendingOperator{PendingOperator::Kind::CALL, function, 1};
+					current += 2;
+				} else {
+					break;
+				}
+			}
+
+			if (Check(TokenType::IDENTIFIER)) {
+				return FailAtToken(Error::Type::UNKNOWN_VARIABLE);
+			}
+			if (!Check(TokenType::LITERAL)) {
+				return FailAtToken(Error::Type::INVALID_TOKEN);
+			}
+			operands[operand_count++] = literals[current++];
+
+			OpCode op = OpCode::PUSH;
+			bool next_argument = false;
+			while (!next_argument && !CheckBinaryOperator(op)) {
+				while (IsOperatorOnTop()) {
+					Reduce(operators[--operator_count].op);
+				}
+				if (operator_count == 0) {
+					if (!IsAtEnd()) {
+						return FailAtToken(Error::Type::INVALID_TOKEN);
+					}
+					result = CanonicalNaN(operands[--operand_count]);
+					return Error::Type::NO_ERROR;
+				}
+				PendingOperator& group = operators[operator_count - 1];
+				bool call = group.kind == PendingOperator::Kind::CALL;
+				if (call && group.arguments < GetArity(group.op)) {
+					if (!Check(TokenType::COMMA)) {
+						return FailAtToken(Error::Type::INVALID_TOKEN);
+					}
+					group.arguments++;
+					current++;
+					next_argument = true;
+					continue;
+				}
+				if (!Check(TokenType::RIGHT_PAREN)) {
+					return FailAtToken(Error::Type::INVALID_TOKEN);
+				}
+				current++;
+				PendingOperator closed = operators[--operator_count];
+				if (closed.kind == PendingOperator::Kind::CALL) {
+					Reduce(closed.op);
+				}
+			}
+			if (next_argument) {
+				continue;
+			}
+
+			current++;
+			while (IsOperatorOnTop() && ReducesBefore(operators[operator_count - 1].op, op)) {
+				Reduce(operators[--operator_count].op);
+			}
+			operators[operator_count++] = PendingOperator{PendingOperator::Kind::OPERATOR, op, 0};
+		}
+	}
+};
+
+// Reached only when a constant expression is invalid. It is deliberately not
+// constexpr, so the compiler reports the call to it
+inline void InvalidConstantExpression() {
+}
+
+namespace calc {
+
+// Evaluates a string literal and sets result, or returns the first error like
+// Calculator::Evaluate(). Runs in a constant expression as well as at run time:
+//     float result;
+//     if (Error error = calc::eval("(3+5)/2", result)) ...
+// "^", "%" and sqrt() are only constant where the compiler folds the library
+// calls and builtins they use, as GCC does
+template <typename Number, size_t N>
+constexpr Error eval(const char (&source)[N], Number& result) {
+	std::string_view view(source, N - 1);
+	ConstantEvaluator<Number, N> evaluator(view);
+	Error::Type type = evaluator.Evaluate(result);
+	return Error(type, evaluator.GetErrorPosition(), view);
+}
+
+// Evaluates a string literal that is known to be valid, in a constant
+// expression when the result is used as one:
+//     constexpr float four = calc::eval("(3+5)/2");
+// An invalid expression fails to compile in a constant expression. There is no
+// error to return at run time, where it gives NaN, so sources that are not
+// checked at compile time go through the overload above
+template <typename Number = float, size_t N>
+constexpr Number eval(const char (&source)[N]) {
+	Number result = 0;
+	if (eval(source, result)) {
+		InvalidConstantExpression();
+		return std::numeric_limits<Number>::quiet_NaN();
+	}
+	return result;
+}
+
+// Formulas built in C++ rather than parsed from a string:
+//     auto area = calc::var<0>() * calc::var<1>() + 2;
+//     float result = area(slots);
+// Every node is a type of its own, so evaluating a formula inlines to its
+// arithmetic with no virtual calls. C++ gives the operators the precedence
+// and associativity of the grammar, "^" is written calc::pow() and functions
+// are called as calc::sqrt() and so on. Everything is applied through
+// Operation, so a formula gives the same result as the same expression parsed
+// for the same Number. Variables are read from slots by index, the slots a
+// SymbolTable gave their names
+
+// Base of every formula node, Derived implements Evaluate()
+template <typename Derived>
+struct Formula {
+	template <typename Number>
+	constexpr Number operator()(const Number* slots) const {
+		return CanonicalNaN(static_cast<const Derived&>(*this).Evaluate(slots));
+	}
+};
+
+template <typename T>
+struct IsFormula : std::is_base_of<Formula<T>, T> {};
+
+// A value is converted to Number when the formula is evaluated. It matches
+// the parsed literal when it is exact in Number, lit(0.1) is rounded to double
+// first and can differ from "0.1" parsed as a float in the last bit
+template <typename Value>
+struct Literal : Formula<Literal<Value>> {
+	constexpr explicit Literal(Value value) : value(value) {
+	}
+
+	template <typename Number = float>
+	constexpr Number Evaluate(const Number* = nullptr) const {
+		return static_cast<Number>(value);
+	}
+
+	Value value;
+};
+
+template <uint32_t SLOT>
+struct Variable : Formula<Variable<SLOT>> {
+	template <typename Number>
+	constexpr Number Evaluate(const Number* slots) const {
+		return slots[SLOT];
+	}
+};
+
+template <OpCode OP, typename Lhs, typename Rhs>
+struct Binary : Formula<Binary<OP, Lhs, Rhs>> {
+	constexpr Binary(Lhs lhs, Rhs rhs) : lhs(lhs), rhs(rhs) {
+	}
+
+	// Both operand types must agree on Number, a formula with a variable needs
+	// the slots to deduce it from
+	template <typename Number = float>
+	constexpr Number Evaluate(const Number* slots = nullptr) const {
+		return Operation<OP>::Apply(lhs.Evaluate(slots), rhs.Evaluate(slots));
+	}
+
+	Lhs lhs;
+	Rhs rhs;
+};
+
+template <OpCode OP, typename Operand>
+struct Unary : Formula<Unary<OP, Operand>> {
+	constexpr explicit Unary(Operand operand) : operand(operand) {
+	}
+
+	template <typename Number = float>
+	constexpr Number Evaluate(const Number* slots = nullptr) const {
+		return Operation<OP>::Apply(operand.Evaluate(slots));
+	}
+
+	Operand operand;
+};
+
+template <typename Value>
+constexpr Literal<Value> lit(Value value) {
+	return Literal<Value>(value);
+}
+
+template <uint32_t SLOT>
+constexpr Variable<SLOT> var() {
+	return Variable<SLOT>();
+}
+
+// Numbers mixed into a formula, like the 2 in var<0>() * 2, become literals
+template <typename T>
+constexpr auto MakeOperand(T operand) {
+	if constexpr (IsFormula<T>::value) {
+		return operand;
+	} else {
+		return Literal<T>(operand);
+	}
+}
+
+template <OpCode OP, typename Lhs, typename Rhs>
+constexpr auto MakeBinary(Lhs lhs, Rhs rhs) {
+	auto left = MakeOperand(lhs);
+	auto right = MakeOperand(rhs);
+	return Binary<OP, decltype(left), decltype(right)>(left, right);
+}
+
+// The operators only take part in overload resolution when a side is a formula
+template <typename Lhs, typename Rhs>
+using EnableOperator = std::enable_if_t<IsFormula<Lhs>::value || IsFormula<Rhs>::value, int>;
+
+template <typename Lhs, typename Rhs, EnableOperator<Lhs, Rhs> = 0>
+constexpr auto operator+(Lhs lhs, Rhs rhs) {
+	return MakeBinary<OpCode::ADD>(lhs, rhs);
+}
+
+template <typename Lhs, typename Rhs, EnableOperator<Lhs, Rhs> = 0>
+constexpr auto operator-(Lhs lhs, Rhs rhs) {
+	return MakeBinary<OpCode::SUB>(lhs, rhs);
+}
+
+template <typename Lhs, typename Rhs, EnableOperator<Lhs, Rhs> = 0>
+constexpr auto operator*(Lhs lhs, Rhs rhs) {
+	return MakeBinary<OpCode::MUL>(lhs, rhs);
+}
+
+template <typename Lhs, typename Rhs, EnableOperator<Lhs, Rhs> = 0>
+constexpr auto operator/(Lhs lhs, Rhs rhs) {
+	return MakeBinary<OpCode::DIV>(lhs, rhs);
+}
+
+template <typename Lhs, typename Rhs, EnableOperator<Lhs, Rhs> = 0>
+constexpr auto operator%(Lhs lhs, Rhs rhs) {
+	return MakeBinary<OpCode::MOD>(lhs, rhs);
+}
+
+// "^" binds looser than "+" in C++, so powers are written as a function
+template <typename Lhs, typename Rhs, EnableOperator<Lhs, Rhs> = 0>
+constexpr auto pow(Lhs lhs, Rhs rhs) {
+	return MakeBinary<OpCode::POW>(lhs, rhs);
+}
+
+template <typename Lhs, typename Rhs, EnableOperator<Lhs, Rhs> = 0>
+constexpr auto min(Lhs lhs, Rhs rhs) {
+	return MakeBinary<OpCode::MIN>(lhs, rhs);
+}
+
+template <typename Lhs, typename Rhs, EnableOperator<Lhs, Rhs> = 0>
+constexpr auto max(Lhs lhs, Rhs rhs) {
+	return MakeBinary<OpCode::MAX>(lhs, rhs);
+}
+
+template <typename Operand, EnableOperator<Operand, Operand> = 0>
+constexpr auto operator-(Operand operand) {
+	return Unary<OpCode::NEG, Operand>(operand);
+}
+
+template <typename Operand, EnableOperator<Operand, Operand> = 0>
+constexpr auto sqrt(Operand operand) {
+	return Unary<OpCode::SQRT, Operand>(operand);
+}
+
+template <typename Operand, EnableOperator<Operand, Operand> = 0>
+constexpr auto exp(Operand operand) {
+	return Unary<OpCode::EXP, Operand>(operand);
+}
+
+template <typename Operand, EnableOperator<Operand, Operand> = 0>
+constexpr auto log(Operand operand) {
+	return Unary<OpCode::LOG, Operand>(operand);
+}
+
+} // namespace calc
+
+template <typename Number = float>
+class VirtualMachine {
+public:
+	// slots must hold a value for every variable the program was compiled against
+	Number Execute(const Program<Number>& program, const Number* slots = nullptr) {
+		InstructionRange<Number> instructions = program.GetInstructions();
+		// Temporaries are kept after the deepest the stack gets
+		size_t size = program.GetMaxDepth() + program.GetTemporaryCount();
+		if (stack.size() < size) {
+			stack.resize(size);
+		}
+
+		// top points one past the last value on the stack
+		Number* top = stack.data();
+		Number* temporaries = stack.data() + program.GetMaxDepth();
+		for (const Instruction<Number>& instruction : instructions) {
+			switch (instruction.op) {
+			case OpCode::PUSH:
+				*top++ = instruction.value;
+				break;
+			case OpCode::LOAD:
+				*top++ = slots[instruction.slot];
+				break;
+			case OpCode::ADD:
+				top--;
+				top[-1] = Operation<OpCode::ADD>::Apply(top[-1], top[0]);
+				break;
+			case OpCode::SUB:
+				top--;
+				top[-1] = Operation<OpCode::SUB>::Apply(top[-1], top[0]);
+				break;
+			case OpCode::MUL:
+				top--;
+				top[-1] = Operation<OpCode::MUL>::Apply(top[-1], top[0]);
+				break;
+			case OpCode::DIV:
+				top--;
+				top[-1] = Operation<OpCode::DIV>::Apply(top[-1], top[0]);
+				break;
+			case OpCode::STORE:
+				temporaries[instruction.slot] = top[-1];
+				break;
+			case OpCode::RECALL:
+				*top++ = temporaries[instruction.slot];
+				break;
+			case OpCode::NEG:
+				top[-1] = Operation<OpCode::NEG>::Apply(top[-1]);
+				break;
+			case OpCode::POW:
+				top--;
+				top[-1] = Operation<OpCode::POW>::Apply(top[-1], top[0]);
+				break;
+			case OpCode::MOD:
+				top--;
+				top[-1] = Operation<OpCode::MOD>::Apply(top[-1], top[0]);
+				break;
+			case OpCode::SQRT:
+				top[-1] = Operation<OpCode::SQRT>::Apply(top[-1]);
+				break;
+			case OpCode::EXP:
+				top[-1] = Operation<OpCode::EXP>::Apply(top[-1]);
+				break;
+			case OpCode::LOG:
+				top[-1] = Operation<OpCode::LOG>::Apply(top[-1]);
+				break;
+			case OpCode::MIN:
+				top--;
+				top[-1] = Operation<OpCode::MIN>::Apply(top[-1], top[0]);
+				break;
+			case OpCode::MAX:
+				top--;
+				top[-1] = Operation<OpCode::MAX>::Apply(top[-1], top[0]);
+				break;
+			}
+		}
+		return CanonicalNaN(stack[0]);
+	}
+
+private:
+	std::vector<Number> stack;
+};
+
+// Vector of numbers the compiler lowers to whatever SIMD the target has, 1 AVX-512,
+// 2 AVX or 4 SSE/NEON operations per arithmetic operation. Number types without
+// hardware vector support are processed one at a time.
+template <typename Number>
+struct SimdLanes {
+	typedef Number Type;
+};
+
+template <>
+struct SimdLanes<float> {
+	typedef float Type __attribute__((vector_size(64)));
+};
+
+template <>
+struct SimdLanes<double> {
+	typedef double Type __attribute__((vector_size(64)));
+};
+
+// On x86 the block kernel is compiled for several instruction sets and the best
+// one is picked when the program is loaded. Clones with fused multiply-adds
+// must not use them for exp() and log()
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CALCULATOR_SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default"))) CALCULATOR_NO_CONTRACT
+#else
+#define CALCULATOR_SIMD_CLONES CALCULATOR_NO_CONTRACT
+#endif
+
+// Rows evaluated together by a ColumnEvaluator
+constexpr size_t COLUMN_BLOCK_SIZE = 256;
+
+// Applies a unary operator to a block of values in place, as a loop that is
+// vectorised for the clone of the kernel it is inlined into. exp() and log()
+// of float and double run the kernels inline. A loop of std::sqrt() keeps a
+// branch for errno and is never vectorised, so square roots use SSE2
+template <OpCode OP, typename Number>
+__attribute__((always_inline)) inline void ApplyToBlock(Number* values) {
+	constexpr bool KERNELS = std::is_same<Number, float>::value || std::is_same<Number, double>::value;
+#if defined(__SSE2__)
+	if constexpr (OP == OpCode::SQRT && std::is_same<Number, float>::value) {
+		for (size_t i = 0; i < COLUMN_BLOCK_SIZE; i += 4) {
+			_mm_store_ps(values + i, _mm_sqrt_ps(_mm_load_ps(values + i)));
+		}
+		return;
+	} else if constexpr (OP == OpCode::SQRT && std::is_same<Number, double>::value) {
+		for (size_t i = 0; i < COLUMN_BLOCK_SIZE; i += 2) {
+			_mm_store_pd(values + i, _mm_sqrt_pd(_mm_load_pd(values + i)));
+		}
+		return;
+	}
+#endif
+	for (size_t i = 0; i < COLUMN_BLOCK_SIZE; i++) {
+		if constexpr (KERNELS && OP == OpCode::EXP) {
+			values[i] = static_cast<Number>(MathKernels::Exp(values[i]));
+		} else if constexpr (KERNELS && OP == OpCode::LOG) {
+			values[i] = static_cast<Number>(MathKernels::Log(values[i]));
+		} else {
+			values[i] = Operation<OP>::Apply(values[i]);
+		}
+	}
+}
+
+// Applies "^" or "%" to two blocks of values, into the first. For float both
+// run the kernels inline, "%" only calls std::fmod() for the values the kernel
+// cannot give exactly. Other types make a library call for every value
+template <OpCode OP, typename Number>
+__attribute__((always_inline)) inline void ApplyToBlocks(Number* lhs, const Number* rhs) {
+	if constexpr (OP == OpCode::POW && std::is_same<Number, float>::value) {
+		for (size_t i = 0; i < COLUMN_BLOCK_SIZE; i++) {
+			lhs[i] = static_cast<float>(MathKernels::Pow(lhs[i], rhs[i]));
+		}
+	} else if constexpr (OP == OpCode::MOD && std::is_same<Number, float>::value) {
+		float remainders[COLUMN_BLOCK_SIZE];
+		size_t inexact = 0;
+		for (size_t i = 0; i < COLUMN_BLOCK_SIZE; i++) {
+			remainders[i] = static_cast<float>(MathKernels::Mod(lhs[i], rhs[i]));
+			inexact += remainders[i] != remainders[i];
+		}
+		for (size_t i = 0; inexact != 0 && i < COLUMN_BLOCK_SIZE; i++) {
+			if (remainders[i] != remainders[i]) {
+				remainders[i] = Operation<OP>::Apply(lhs[i], rhs[i]);
+			}
+		}
+		std::memcpy(lhs, remainders, sizeof(remainders));
+	} else {
+		for (size_t i = 0; i < COLUMN_BLOCK_SIZE; i++) {
+			lhs[i] = Operation<OP>::Apply(lhs[i], rhs[i]);
+		}
+	}
+}
+
+// Applies a program to one block of rows of a ColumnEvaluator. A partial block
+// is padded with zeros, the padding rows are computed but never copied out.
+// Every temporary of the program holds a block in temporaries
+template <typename Number, typename Lanes = typename SimdLanes<Number>::Type>
+__attribute__((always_inline)) inline void ExecuteColumnBlock(const Instruction<Number>* instructions, size_t size, const Number* const* columns, size_t row, size_t count, Lanes* stack,
+															  Lanes* temporaries) {
+	constexpr size_t BLOCK_SIZE = COLUMN_BLOCK_SIZE;
+	constexpr size_t LANES_PER_BLOCK = BLOCK_SIZE / (sizeof(Lanes) / sizeof(Number));
+
+	// top points one past the last block on the stack
+	Lanes* top = stack;
+	for (size_t i = 0; i < size; i++) {
+		const Instruction<Number>& instruction = instructions[i];
+		switch (instruction.op) {
+		case OpCode::PUSH:
+			for (size_t lane = 0; lane < LANES_PER_BLOCK; lane++) {
+				top[lane] = instruction.value - Lanes{};
+			}
+			top += LANES_PER_BLOCK;
+			break;
+		case OpCode::LOAD:
+			if (count < BLOCK_SIZE) {
+				std::memset(top, 0, BLOCK_SIZE * sizeof(Number));
+			}
+			std::memcpy(top, columns[instruction.slot] + row, count * sizeof(Number));
+			top += LANES_PER_BLOCK;
+			break;
+		case OpCode::ADD: {
+			Lanes* rhs = top -= LANES_PER_BLOCK;
+			Lanes* lhs = rhs - LANES_PER_BLOCK;
+			for (size_t lane = 0; lane < LANES_PER_BLOCK; lane++) {
+				lhs[lane] = lhs[lane] + rhs[lane];
+			}
+			break;
+		}
+		case OpCode::SUB: {
+			Lanes* rhs = top -= LANES_PER_BLOCK;
+			Lanes* lhs = rhs - LANES_PER_BLOCK;
+			for (size_t lane = 0; lane < LANES_PER_BLOCK; lane++) {
+				lhs[lane] = lhs[lane] - rhs[lane];
+			}
+			break;
+		}
+		case OpCode::MUL: {
+			Lanes* rhs = top -= LANES_PER_BLOCK;
+			Lanes* lhs = rhs - LANES_PER_BLOCK;
+			for (size_t lane = 0; lane < LANES_PER_BLOCK; lane++) {
+				lhs[lane] = lhs[lane] * rhs[lane];
+			}
+			break;
+		}
+		case OpCode::DIV: {
+			Lanes* rhs = top -= LANES_PER_BLOCK;
+			Lanes* lhs = rhs - LANES_PER_BLOCK;
+			for (size_t lane = 0; lane < LANES_PER_BLOCK; lane++) {
+				lhs[lane] = lhs[lane] / rhs[lane];
+			}
+			break;
+		}
+		case OpCode::STORE:
+			std::memcpy(temporaries + instruction.slot * LANES_PER_BLOCK, top - LANES_PER_BLOCK, BLOCK_SIZE * sizeof(Number));
+			break;
+		case OpCode::RECALL:
+			std::memcpy(top, temporaries + instruction.slot * LANES_PER_BLOCK, BLOCK_SIZE * sizeof(Number));
+			top += LANES_PER_BLOCK;
+			break;
+		case OpCode::NEG:
+			ApplyToBlock<OpCode::NEG>(reinterpret_cast<Number*>(top - LANES_PER_BLOCK));
+			break;
+		case OpCode::POW: {
+			Lanes* rhs = top -= LANES_PER_BLOCK;
+			Lanes* lhs = rhs - LANES_PER_BLOCK;
+			ApplyToBlocks<OpCode::POW>(reinterpret_cast<Number*>(lhs), reinterpret_cast<const Number*>(rhs));
+			break;
+		}
+		case OpCode::MOD: {
+			Lanes* rhs = top -= LANES_PER_BLOCK;
+			Lanes* lhs = rhs - LANES_PER_BLOCK;
+			ApplyToBlocks<OpCode::MOD>(reinterpret_cast<Number*>(lhs), reinterpret_cast<const Number*>(rhs));
+			break;
+		}
+		case OpCode::SQRT:
+			ApplyToBlock<OpCode::SQRT>(reinterpret_cast<Number*>(top - LANES_PER_BLOCK));
+			break;
+		case OpCode::EXP:
+			ApplyToBlock<OpCode::EXP>(reinterpret_cast<Number*>(top - LANES_PER_BLOCK));
+			break;
+		case OpCode::LOG:
+			ApplyToBlock<OpCode::LOG>(reinterpret_cast<Number*>(top - LANES_PER_BLOCK));
+			break;
+		// A compare and select, which gives rhs for NaN and equal zeros like
+		// Operation does
+		case OpCode::MIN: {
+			Lanes* rhs = top -= LANES_PER_BLOCK;
+			Lanes* lhs = rhs - LANES_PER_BLOCK;
+			for (size_t lane = 0; lane < LANES_PER_BLOCK; lane++) {
+				lhs[lane] = lhs[lane] < rhs[lane] ? lhs[lane] : rhs[lane];
+			}
+			break;
+		}
+		case OpCode::MAX: {
+			Lanes* rhs = top -= LANES_PER_BLOCK;
+			Lanes* lhs = rhs - LANES_PER_BLOCK;
+			for (size_t lane = 0; lane < LANES_PER_BLOCK; lane++) {
+				lhs[lane] = lhs[lane] > rhs[lane] ? lhs[lane] : rhs[lane];
+			}
+			break;
+		}
+		}
+	}
+}
+
+// GCC cannot dispatch the clones of a template, so the types with hardware
+// vector support get plain functions that the kernel is inlined into. They are
+// compiled once, with their clones, in libcalculator.cpp
+void ExecuteSimdBlock(const Instruction<float>* instructions, size_t size, const float* const* columns, size_t row, size_t count, SimdLanes<float>::Type* stack,
+					  SimdLanes<float>::Type* temporaries);
+void ExecuteSimdBlock(const Instruction<double>* instructions, size_t size, const double* const* columns, size_t row, size_t count, SimdLanes<double>::Type* stack,
+					  SimdLanes<double>::Type* temporaries);
+
+template <typename Number>
+void ExecuteSimdBlock(const Instruction<Number>* instructions, size_t size, const Number* const* columns, size_t row, size_t count, typename SimdLanes<Number>::Type* stack,
+					  typename SimdLanes<Number>::Type* temporaries) {
+	ExecuteColumnBlock(instructions, size, columns, row, count, stack, temporaries);
+}
+
+// Evaluates a program over columns of variable values. Every instruction is
+// applied to a whole block of rows before the next one, so the interpreter
+// overhead is paid once per block and the arithmetic runs as SIMD loops
+template <typename Number = float>
+class ColumnEvaluator {
+public:
+	typedef typename SimdLanes<Number>::Type Lanes;
+
+	static constexpr size_t BLOCK_SIZE = COLUMN_BLOCK_SIZE;
+	static constexpr size_t LANES_PER_BLOCK = BLOCK_SIZE / (sizeof(Lanes) / sizeof(Number));
+
+	// columns[slot] points to the values of that variable for every row, results
+	// receives one value per row
+	void Execute(const Program<Number>& program, const Number* const* columns, Number* results, size_t rows) {
+		InstructionRange<Number> instructions = program.GetInstructions();
+		// Temporaries are kept after the deepest the stack gets
+		size_t depth = (program.GetMaxDepth() + program.GetTemporaryCount()) * LANES_PER_BLOCK;
+		if (depth > stack_size) {
+			stack.reset(static_cast<Lanes*>(std::aligned_alloc(STACK_ALIGNMENT, depth * sizeof(Lanes))));
+			if (!stack) {
+				throw std::bad_alloc();
+			}
+			stack_size = depth;
+		}
+
+		for (size_t row = 0; row < rows; row += BLOCK_SIZE) {
+			size_t count = std::min(BLOCK_SIZE, rows - row);
+			ExecuteSimdBlock(instructions.data(), instructions.size(), columns, row, count, stack.get(),
+							 stack.get() + program.GetMaxDepth() * LANES_PER_BLOCK);
+			std::memcpy(results + row, stack.get(), count * sizeof(Number));
+		}
+		for (size_t row = 0; row < rows; row++) {
+			results[row] = CanonicalNaN(results[row]);
+		}
+	}
+
+private:
+	struct FreeDeleter {
+		void operator()(void* pointer) const {
+			std::free(pointer);
+		}
+	};
+
+	// The baseline target only aligns Lanes to 16 bytes, but the AVX-512 clone of
+	// the kernel uses aligned 64 byte loads, so the stack is allocated by hand
+	static constexpr size_t STACK_ALIGNMENT = 64;
+
+	std::unique_ptr<Lanes, FreeDeleter> stack;
+	size_t stack_size = 0;
+};
+
+// Evaluates one large AST on several threads. Operands of at least cutoff
+// nodes, or runs of smaller ones along a path that add up to it, become tasks
+// on a work stealing pool: a thread pushes them onto its own deque and keeps
+// evaluating the rest of the subtree, idle threads steal the oldest tasks of
+// others. Small subtrees are evaluated by Expression::Evaluate with the same
+// arithmetic, so results match it exactly. Like it every node is computed once
+// per evaluation, whichever thread reaches a shared node first stores its value
+// for the others. The subtree sizes are counted on the first evaluation of a
+// tree and kept in its nodes for the next ones. One evaluation runs at a time,
+// the pool's threads sleep between them. A Calculator whose options ask for
+// more than one tree thread runs the trees it splits on one instead of
+// compiling them
+template <typename Number = float>
+class ParallelEvaluator {
+public:
+	static constexpr size_t DEFAULT_CUTOFF = 1 << 13;
+
+	// threads counts the calling thread, which takes part in every evaluation
+	ParallelEvaluator(size_t threads = std::thread::hardware_concurrency(), size_t cutoff = DEFAULT_CUTOFF)
+		: cutoff(std::max<size_t>(cutoff, 1)), slots(nullptr) {
+		for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+			workers.emplace_back(new Worker());
+		}
+		for (size_t i = 1; i < workers.size(); i++) {
+			pool.emplace_back(&ParallelEvaluator::Run, this, i);
+		}
+	}
+
+	ParallelEvaluator(const ParallelEvaluator&) = delete;
+	ParallelEvaluator& operator=(const ParallelEvaluator&) = delete;
+
+	~ParallelEvaluator() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread& thread : pool) {
+			thread.join();
+		}
+	}
+
+	// Whether Evaluate() shares root out between the threads rather than walking
+	// it on the calling thread alone. Measures the tree if it was not yet
+	bool Splits(const Expression<Number>* root) {
+		if (workers.size() == 1) {
+			return false;
+		}
+		// Every node has a size of at least one once it is measured
+		if (root->size == 0) {
+			Measure(const_cast<Expression<Number>*>(root));
+		}
+		return root->size >= 2 * cutoff;
+	}
+
+	Number Evaluate(const Expression<Number>* root, const Number* slots) {
+		Expression<Number>* node = const_cast<Expression<Number>*>(root);
+		if (!Splits(root)) {
+			return root->Evaluate(slots);
+		}
+
+		this->slots = slots;
+		evaluation = Expression<Number>::NextWalk(2);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = true;
+		}
+		wake.notify_all();
+		Number value = CanonicalNaN(EvaluateTask(node, 0));
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		return value;
+	}
+
+private:
+	// Operands evaluated by whichever thread gets to them first
+	struct Task {
+		std::vector<Expression<Number>*> nodes;
+		std::vector<Number> values;
+		std::atomic<bool> done{false};
+	};
+
+	// A node on the way down, side is the operand that was walked into and the
+	// sibling is evaluated by a task if it has one. Unary nodes and nodes with the
+	// same operand twice have no sibling
+	struct Step {
+		Expression<Number>* node;
+		Expression<Number>* sibling;
+		Task* task;
+		uint32_t index;
+		uint32_t side;
+	};
+
+	// Owners push and pop at the back, thieves take from the front. Tasks are
+	// at least cutoff nodes of work, so a lock per deque costs little
+	struct alignas(64) Worker {
+		std::mutex mutex;
+		std::deque<Task*> tasks;
+	};
+
+	size_t cutoff;
+	const Number* slots;
+	uint64_t evaluation = 0;
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> pool;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool running = false;
+	bool stopping = false;
+
+private:
+	// Stores the number of nodes below every node in its size. A shared node is
+	// counted only in the first parent that is measured, as it is computed once,
+	// so the size of the root is the number of nodes in the tree. Nodes are
+	// marked measured once counted and claimed once a parent has counted them
+	static void Measure(Expression<Number>* root) {
+		uint64_t measured = Expression<Number>::NextWalk(2);
+		uint64_t claimed = measured + 1;
+		auto enter = [&](Expression<Number>* node) { return node->walk != measured && node->walk != claimed; };
+		auto count = [&](Expression<Number>* node) {
+			uint64_t size = 1;
+			for (size_t i = 0; i < node->GetOperandCount(); i++) {
+				Expression<Number>* operand = *node->GetOperand(i);
+				if (operand->walk == measured) {
+					size += operand->size;
+					operand->walk = claimed;
+				}
+			}
+			node->walk = measured;
+			node->size = static_cast<uint32_t>(std::min<uint64_t>(size, std::numeric_limits<uint32_t>::max()));
+		};
+		WalkPostOrder(root, enter, count);
+	}
+
+	bool IsLarge(const Expression<Number>* node) const {
+		return node->size >= cutoff;
+	}
+
+	// Walks down the larger operand of every large node and leaves the other
+	// operands for later. As soon as those add up to cutoff nodes they become a
+	// task, so both a split into two large subtrees and a long chain of small
+	// operands are shared out. The operands are combined on the way back up,
+	// which joins the tasks in the reverse order of their pushes
+	Number EvaluateTask(Expression<Number>* node, size_t worker) {
+		std::vector<Step> path;
+		std::deque<Task> tasks;
+		size_t batch = 0;
+		uint64_t batch_size = 0;
+		Number value;
+		while (!node->Recall(evaluation, value)) {
+			if (node->GetOperandCount() == 0 || !IsLarge(node)) {
+				value = node->EvaluateRecursively(slots, evaluation, 0);
+				break;
+			}
+			if (node->GetOperandCount() == 1) {
+				path.push_back(Step{node, nullptr, nullptr, 0, 0});
+				node = *node->GetOperand(0);
+				continue;
+			}
+			Expression<Number>* operands[2] = {*node->GetOperand(0), *node->GetOperand(1)};
+			uint32_t side = operands[0]->size >= operands[1]->size ? 0 : 1;
+			if (operands[0] == operands[1]) {
+				path.push_back(Step{node, nullptr, nullptr, 0, side});
+				node = operands[side];
+				continue;
+			}
+			Expression<Number>* sibling = operands[1 - side];
+			path.push_back(Step{node, sibling, nullptr, 0, side});
+			batch_size += sibling->size;
+			if (batch_size >= cutoff) {
+				tasks.emplace_back();
+				Task& task = tasks.back();
+				for (size_t i = batch; i < path.size(); i++) {
+					if (path[i].sibling == nullptr) {
+						continue;
+					}
+					path[i].task = &task;
+					path[i].index = static_cast<uint32_t>(task.nodes.size());
+					task.nodes.push_back(path[i].sibling);
+				}
+				task.values.resize(task.nodes.size());
+				Push(worker, &task);
+				batch = path.size();
+				batch_size = 0;
+			}
+			node = operands[side];
+		}
+
+		for (size_t i = path.size(); i-- > 0;) {
+			const Step& step = path[i];
+			// Nodes without a sibling take the value for every operand
+			Number operands[2] = {value, value};
+			if (step.task != nullptr) {
+				if (step.index + 1 == step.task->nodes.size()) {
+					Join(*step.task, worker);
+				}
+				operands[1 - step.side] = step.task->values[step.index];
+			} else if (step.sibling != nullptr) {
+				operands[1 - step.side] = step.sibling->EvaluateRecursively(slots, evaluation, 0);
+			}
+			value = step.node->Apply(operands, slots);
+			step.node->Remember(evaluation, value);
+		}
+		return value;
+	}
+
+	void Push(size_t worker, Task* task) {
+		std::lock_guard<std::mutex> lock(workers[worker]->mutex);
+		workers[worker]->tasks.push_back(task);
+	}
+
+	// Takes the newest task of the worker's own deque, or the oldest of another
+	Task* Take(size_t worker) {
+		{
+			Worker& own = *workers[worker];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.tasks.empty()) {
+				Task* task = own.tasks.back();
+				own.tasks.pop_back();
+				return task;
+			}
+		}
+		for (size_t i = 1; i < workers.size(); i++) {
+			Worker& victim = *workers[(worker + i) % workers.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tasks.empty()) {
+				Task* task = victim.tasks.front();
+				victim.tasks.pop_front();
+				return task;
+			}
+		}
+		return nullptr;
+	}
+
+	void Execute(Task* task, size_t worker) {
+		for (size_t i = 0; i < task->nodes.size(); i++) {
+			task->values[i] = EvaluateTask(task->nodes[i], worker);
+		}
+		task->done.store(true, std::memory_order_release);
+	}
+
+	// Runs other tasks until the given one is done. If it was not stolen it is
+	// the newest task on the worker's own deque, so it is taken back first
+	void Join(Task& task, size_t worker) {
+		while (!task.done.load(std::memory_order_acquire)) {
+			if (Task* other = Take(worker)) {
+				Execute(other, worker);
+			} else {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	// Pool threads steal while an evaluation is running and sleep otherwise
+	void Run(size_t worker) {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&]() { return running || stopping; });
+				if (stopping) {
+					return;
+				}
+			}
+			while (true) {
+				if (Task* task = Take(worker)) {
+					Execute(task, worker);
+					continue;
+				}
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!running || stopping) {
+						break;
+					}
+				}
+				std::this_thread::yield();
+			}
+		}
+	}
+};
+
+// Translates a program into native code. The operand stack is mapped onto the
+// SSE registers and temporaries live in the red zone below the stack pointer,
+// so a program that needs more than 16 registers or temporaries, a number type
+// other than float or double, or a platform other than x86-64 is not supported
+// and must stay on the interpreter. So must programs that use ^, %, exp() or
+// log(), which have no SSE instruction and would need calls
+template <typename Number = float>
+class JitFunction {
+public:
+	typedef Number (*Signature)(const Number* slots);
+
+	static constexpr bool SUPPORTED = std::is_same<Number, float>::value || std::is_same<Number, double>::value;
+
+	JitFunction() : code(nullptr), size(0) {
+	}
+
+	JitFunction(const JitFunction&) = delete;
+	JitFunction& operator=(const JitFunction&) = delete;
+
+	~JitFunction() {
+		if (code != nullptr) {
+			munmap(code, size);
+		}
+	}
+
+	bool Compile(const Program<Number>& program) {
+#if defined(__x86_64__)
+		if (!SUPPORTED || program.GetMaxDepth() > 16 || program.GetTemporaryCount() > 16) {
+			return false;
+		}
+
+		// Scalar single (ss) or scalar double (sd) variant of every SSE instruction
+		const uint8_t scalar_prefix = sizeof(Number) == 4 ? 0xF3 : 0xF2;
+
+		std::vector<uint8_t> buffer;
+		size_t depth = 0;
+		for (const Instruction<Number>& instruction : program.GetInstructions()) {
+			switch (instruction.op) {
+			case OpCode::PUSH: {
+				uint64_t bits = 0;
+				std::memcpy(&bits, &instruction.value, sizeof(Number));
+				EmitConstant(buffer, depth, bits);
+				depth++;
+				break;
+			}
+			case OpCode::LOAD:
+				if (instruction.slot > INT32_MAX / sizeof(Number)) {
+					return false;
+				}
+				// movss/movsd xmm(depth), [rdi + slot * sizeof(Number)]
+				buffer.push_back(scalar_prefix);
+				EmitRex(buffer, depth, 0);
+				buffer.insert(buffer.end(), {0x0F, 0x10, ModRM(0b10, depth, 7)});
+				EmitImmediate(buffer, instruction.slot * sizeof(Number), 4);
+				depth++;
+				break;
+			case OpCode::ADD:
+			case OpCode::SUB:
+			case OpCode::MUL:
+			case OpCode::DIV:
+			case OpCode::MIN:
+			case OpCode::MAX:
+				// add/sub/mul/div/min/max xmm(depth - 2), xmm(depth - 1)
+				depth--;
+				buffer.push_back(scalar_prefix);
+				EmitRex(buffer, depth - 1, depth);
+				buffer.insert(buffer.end(), {0x0F, ArithmeticOpcode(instruction.op), ModRM(0b11, depth - 1, depth)});
+				break;
+			case OpCode::NEG:
+				// The sign mask goes into the register above the operand, then
+				// xorps xmm(depth - 1), xmm(depth)
+				if (depth == 16) {
+					return false;
+				}
+				EmitConstant(buffer, depth, sizeof(Number) == 4 ? uint64_t(1) << 31 : uint64_t(1) << 63);
+				EmitRex(buffer, depth - 1, depth);
+				buffer.insert(buffer.end(), {0x0F, 0x57, ModRM(0b11, depth - 1, depth)});
+				break;
+			case OpCode::SQRT:
+				// sqrtss/sqrtsd xmm(depth - 1), xmm(depth - 1)
+				buffer.push_back(scalar_prefix);
+				EmitRex(buffer, depth - 1, depth - 1);
+				buffer.insert(buffer.end(), {0x0F, 0x51, ModRM(0b11, depth - 1, depth - 1)});
+				break;
+			case OpCode::POW:
+			case OpCode::MOD:
+			case OpCode::EXP:
+			case OpCode::LOG:
+				return false;
+			case OpCode::STORE:
+				// movss/movsd [rsp - 8 * (temporary + 1)], xmm(depth - 1)
+				buffer.push_back(scalar_prefix);
+				EmitRex(buffer, depth - 1, 4);
+				buffer.insert(buffer.end(), {0x0F, 0x11, ModRM(0b01, depth - 1, 4), 0x24, TemporaryOffset(instruction.slot)});
+				break;
+			case OpCode::RECALL:
+				// movss/movsd xmm(depth), [rsp - 8 * (temporary + 1)]
+				buffer.push_back(scalar_prefix);
+				EmitRex(buffer, depth, 4);
+				buffer.insert(buffer.end(), {0x0F, 0x10, ModRM(0b01, depth, 4), 0x24, TemporaryOffset(instruction.slot)});
+				depth++;
+				break;
+			}
+		}
+		// The result is already in xmm0
+		buffer.push_back(0xC3);
+
+		void* memory = mmap(nullptr, buffer.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED) {
+			return false;
+		}
+		std::memcpy(memory, buffer.data(), buffer.size());
+		if (mprotect(memory, buffer.size(), PROT_READ | PROT_EXEC) != 0) {
+			munmap(memory, buffer.size());
+			return false;
+		}
+		code = memory;
+		size = buffer.size();
+		return true;
+#else
+		(void)program;
+		return false;
+#endif
+	}
+
+	bool IsCompiled() const {
+		return code != nullptr;
+	}
+
+	Number operator()(const Number* slots) const {
+		return CanonicalNaN(reinterpret_cast<Signature>(code)(slots));
+	}
+
+private:
+	void* code;
+	size_t size;
+
+private:
+	static uint8_t ModRM(uint8_t mod, size_t reg, size_t rm) {
+		return static_cast<uint8_t>(mod << 6 | (reg & 7) << 3 | (rm & 7));
+	}
+
+	// Only needed to reach xmm8-xmm15 or for 64 bit operands
+	static void EmitRex(std::vector<uint8_t>& buffer, size_t reg, size_t rm, bool wide = false) {
+		if (reg >= 8 || rm >= 8 || wide) {
+			buffer.push_back(static_cast<uint8_t>(0x40 | wide << 3 | (reg >= 8) << 2 | (rm >= 8)));
+		}
+	}
+
+	// The generated code calls nothing, so the 128 bytes below rsp are free to use
+	// without adjusting it
+	static uint8_t TemporaryOffset(uint32_t temporary) {
+		return static_cast<uint8_t>(-8 * static_cast<int>(temporary + 1));
+	}
+
+	static void EmitImmediate(std::vector<uint8_t>& buffer, uint64_t value, size_t bytes) {
+		for (size_t i = 0; i < bytes; i++) {
+			buffer.push_back(static_cast<uint8_t>(value >> (i * 8)));
+		}
+	}
+
+	// mov eax/rax, imm ; movd/movq xmm(reg), eax/rax
+	static void EmitConstant(std::vector<uint8_t>& buffer, size_t reg, uint64_t bits) {
+		const bool wide = sizeof(Number) == 8;
+		EmitRex(buffer, 0, 0, wide);
+		buffer.push_back(0xB8);
+		EmitImmediate(buffer, bits, sizeof(Number));
+		buffer.push_back(0x66);
+		EmitRex(buffer, reg, 0, wide);
+		buffer.insert(buffer.end(), {0x0F, 0x6E, ModRM(0b11, reg, 0)});
+	}
+
+	static uint8_t ArithmeticOpcode(OpCode op) {
+		switch (op) {
+		case OpCode::ADD:
+			return 0x58;
+		case OpCode::SUB:
+			return 0x5C;
+		case OpCode::MUL:
+			return 0x59;
+		case OpCode::MIN:
+			return 0x5D;
+		case OpCode::MAX:
+			return 0x5F;
+		default:
+			return 0x5E;
+		}
+	}
+};
+
+// Compiles an expression once so it can be executed many times with new slot
+// values, every identifier in the source must be declared in the symbol table
+template <typename Number>
+Error Compile(std::string_view source, const SymbolTable& symbols, Program<Number>& program) {
+	Lexer<Number> lexer(source);
+	StreamingParser<Number> parser(lexer, source, symbols);
+	Error error = parser.Parse();
+	if (error) {
+		return error;
+	}
+
+	parser.Optimize();
+	program.Clear();
+	parser.GetAST()->Compile(program);
+	return error;
+}
+
+// Least recently used cache of compiled programs, keyed on normalised source text
+template <typename Number = float>
+class ProgramCache {
+public:
+	ProgramCache(size_t capacity) : capacity(capacity), hits(0), misses(0), jit_compiled(0) {
+	}
+
+	// Whitespace is only significant where it separates two literals or names, so it is
+	// dropped everywhere else and collapsed into a single space there. Characters
+	// are classified as the lexer does, so two sources share a key only if they
+	// lex to the same tokens
+	static void Normalise(std::string_view source, std::string& key) {
+		key.clear();
+		bool pending_space = false;
+		for (char ch : source) {
+			if (Lexer<Number>::IsWhiteSpace(ch)) {
+				pending_space = true;
+				continue;
+			}
+			if (pending_space && !key.empty() && Lexer<Number>::IsWordChar(key.back()) && Lexer<Number>::IsWordChar(ch)) {
+				key += ' ';
+			}
+			pending_space = false;
+			key += ch;
+		}
+	}
+
+	// Cached programs count how often they run so hot ones can be compiled to
+	// native code
+	struct Entry {
+		std::string key;
+		Program<Number> program;
+		size_t evaluations = 0;
+		bool jit_attempted = false;
+		std::unique_ptr<JitFunction<Number>> jit;
+	};
+
+	Entry* Find(std::string_view key) {
+		auto it = index.find(key);
+		if (it == index.end()) {
+			misses++;
+			return nullptr;
+		}
+		hits++;
+		entries.splice(entries.begin(), entries, it->second);
+		return &*it->second;
+	}
+
+	// Once an entry has run jit_threshold times it is compiled to native code,
+	// a threshold of 0 disables the JIT. Returns the native code if there is any
+	const JitFunction<Number>* Tier(Entry& entry, size_t jit_threshold) {
+		entry.evaluations++;
+		if (!entry.jit_attempted && jit_threshold != 0 && entry.evaluations >= jit_threshold) {
+			entry.jit_attempted = true;
+			std::unique_ptr<JitFunction<Number>> jit(new JitFunction<Number>());
+			if (jit->Compile(entry.program)) {
+				entry.jit = std::move(jit);
+				jit_compiled++;
+			}
+		}
+		return entry.jit.get();
+	}
+
+	// The program is swapped with the one of the entry it is stored in. Once the
+	// cache is full the least recently used entry is reused for the new key, with
+	// its list node, index node and buffers, so inserting no longer allocates and
+	// the caller gets the evicted program's buffer back
+	void Insert(std::string_view key, Program<Number>& program) {
+		if (!IsEnabled() || index.find(key) != index.end()) {
+			return;
+		}
+		if (entries.size() == capacity) {
+			auto node = index.extract(entries.back().key);
+			entries.splice(entries.begin(), entries, std::prev(entries.end()));
+			Entry& entry = entries.front();
+			entry.key.assign(key.data(), key.size());
+			entry.evaluations = 0;
+			entry.jit_attempted = false;
+			entry.jit.reset();
+			std::swap(entry.program, program);
+			// The key is owned by the list node, which never moves
+			node.key() = entry.key;
+			index.insert(std::move(node));
+			return;
+		}
+		entries.emplace_front();
+		entries.front().key = std::string(key);
+		std::swap(entries.front().program, program);
+		index.emplace(entries.front().key, entries.begin());
+	}
+
+	bool IsEnabled() const {
+		return capacity != 0;
+	}
+
+	void MergeCounters(const ProgramCache& other) {
+		hits += other.hits;
+		misses += other.misses;
+		jit_compiled += other.jit_compiled;
+	}
+
+	size_t GetHits() const {
+		return hits;
+	}
+
+	size_t GetMisses() const {
+		return misses;
+	}
+
+	size_t GetJitCompiled() const {
+		return jit_compiled;
+	}
+
+	size_t GetSize() const {
+		return entries.size();
+	}
+
+private:
+	size_t capacity;
+	size_t hits;
+	size_t misses;
+	size_t jit_compiled;
+	std::list<Entry> entries;
+	std::unordered_map<std::string_view, typename std::list<Entry>::iterator> index;
+};
+
+enum class StatsFormat { NONE, TEXT, JSON };
+
+// Reads a counter that only has to be monotonic on one thread. On x86 this is
+// the time stamp counter, which costs a few cycles instead of a clock call
+inline uint64_t ReadTimestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Counts values in power of two buckets, bucket b holds values in [2^(b-1), 2^b)
+// and bucket 0 holds zero
+class Histogram {
+public:
+	static constexpr size_t BUCKETS = 65;
+
+	Histogram() : counts() {
+	}
+
+	void Add(uint64_t value) {
+		size_t bucket = 0;
+		while (value != 0) {
+			value >>= 1;
+			bucket++;
+		}
+		counts[bucket]++;
+	}
+
+	void Merge(const Histogram& other) {
+		for (size_t i = 0; i < BUCKETS; i++) {
+			counts[i] += other.counts[i];
+		}
+	}
+
+	size_t GetCount(size_t bucket) const {
+		return counts[bucket];
+	}
+
+	static uint64_t GetMin(size_t bucket) {
+		return bucket == 0 ? 0 : uint64_t(1) << (bucket - 1);
+	}
+
+	static uint64_t GetMax(size_t bucket) {
+		return bucket == 0 ? 0 : GetMin(bucket) * 2 - 1;
+	}
+
+private:
+	size_t counts[BUCKETS];
+};
+
+// Per stage call counts and times of the evaluation pipeline. When disabled every
+// hook is a single predictable branch and the counter is never read. Outside of
+// --debug lexing happens while parsing, so its time is part of the parse stage
+class Stats {
+public:
+	enum Stage { READ, LOOKUP, SCAN, PARSE, OPTIMIZE, COMPILE, EXECUTE, WRITE, STAGE_COUNT };
+
+	Stats(bool enabled) : enabled(enabled), lines(0), errors(0), calls(), ticks() {
+		start_ticks = ReadTimestamp();
+		start_time = std::chrono::steady_clock::now();
+	}
+
+	// Returns the timestamp a stage starts at, pass it to Record() when it ends
+	uint64_t Start() const {
+		return enabled ? ReadTimestamp() : 0;
+	}
+
+	// Adds the time since start to a stage and returns the current timestamp, so
+	// consecutive stages can be chained. Work that finishes an earlier call of the
+	// stage passes a count of 0
+	uint64_t Record(Stage stage, uint64_t start, size_t count = 1) {
+		if (!enabled) {
+			return 0;
+		}
+		uint64_t now = ReadTimestamp();
+		calls[stage] += count;
+		ticks[stage] += now - start;
+		return now;
+	}
+
+	void AddLine(size_t length) {
+		if (enabled) {
+			lines++;
+			lengths.Add(length);
+		}
+	}
+
+	void AddError() {
+		if (enabled) {
+			errors++;
+		}
+	}
+
+	bool IsEnabled() const {
+		return enabled;
+	}
+
+	template <typename Number>
+	void AddExpression(const Expression<Number>* ast) {
+		if (enabled) {
+			depths.Add(ast->GetDepth());
+		}
+	}
+
+	void Merge(const Stats& other) {
+		lines += other.lines;
+		errors += other.errors;
+		for (size_t i = 0; i < STAGE_COUNT; i++) {
+			calls[i] += other.calls[i];
+			ticks[i] += other.ticks[i];
+		}
+		lengths.Merge(other.lengths);
+		depths.Merge(other.depths);
+	}
+
+	// Timestamps are converted to time using the rate the counter ran at since
+	// this object was created
+	void Print(std::ostream& out, StatsFormat format) const {
+		double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start_time).count();
+		uint64_t elapsed_ticks = ReadTimestamp() - start_ticks;
+		double ns_per_tick = elapsed_ticks != 0 ? elapsed / elapsed_ticks : 0;
+
+		if (format == StatsFormat::JSON) {
+			out << "{\"lines\":" << lines << ",\"errors\":" << errors << ",\"elapsed_ns\":" << uint64_t(elapsed) << ",\"stages\":{";
+			const char* separator = "";
+			for (size_t i = 0; i < STAGE_COUNT; i++) {
+				out << separator << '"' << STAGE_NAMES[i] << "\":{\"calls\":" << calls[i] << ",\"ns\":" << uint64_t(ticks[i] * ns_per_tick) << '}';
+				separator = ",";
+			}
+			out << "},\"length\":";
+			PrintJson(out, lengths);
+			out << ",\"ast_depth\":";
+			PrintJson(out, depths);
+			out << "}\n";
+			return;
+		}
+
+		out << "lines: " << lines << ", errors: " << errors << ", elapsed: " << elapsed / 1e6 << " ms\n";
+		for (size_t i = 0; i < STAGE_COUNT; i++) {
+			if (calls[i] != 0) {
+				out << STAGE_NAMES[i] << ": " << calls[i] << " calls, " << ticks[i] * ns_per_tick / 1e6 << " ms, "
+					<< ticks[i] * ns_per_tick / calls[i] << " ns/call\n";
+			}
+		}
+		out << "expression length:\n";
+		PrintText(out, lengths);
+		out << "ast depth:\n";
+		PrintText(out, depths);
+	}
+
+private:
+	static constexpr const char* STAGE_NAMES[STAGE_COUNT] = {"read", "lookup", "scan", "parse", "optimize", "compile", "execute", "write"};
+
+	static void PrintText(std::ostream& out, const Histogram& histogram) {
+		for (size_t i = 0; i < Histogram::BUCKETS; i++) {
+			if (histogram.GetCount(i) != 0) {
+				out << "  " << Histogram::GetMin(i) << "-" << Histogram::GetMax(i) << ": " << histogram.GetCount(i) << '\n';
+			}
+		}
+	}
+
+	static void PrintJson(std::ostream& out, const Histogram& histogram) {
+		out << '[';
+		const char* separator = "";
+		for (size_t i = 0; i < Histogram::BUCKETS; i++) {
+			if (histogram.GetCount(i) != 0) {
+				out << separator << "{\"min\":" << Histogram::GetMin(i) << ",\"max\":" << Histogram::GetMax(i) << ",\"count\":" << histogram.GetCount(i) << '}';
+				separator = ",";
+			}
+		}
+		out << ']';
+	}
+
+	bool enabled;
+	size_t lines;
+	size_t errors;
+	size_t calls[STAGE_COUNT];
+	uint64_t ticks[STAGE_COUNT];
+	Histogram lengths;
+	Histogram depths;
+	uint64_t start_ticks;
+	std::chrono::steady_clock::time_point start_time;
+};
+
+// Named definitions and the variables each one reads. The value of every
+// definition lives in its variable slot, so other expressions read it like any
+// variable. When a definition or a variable it reads changes, only the
+// definitions downstream of it are run again, in dependency order. Every other
+// value is reused as it is
+template <typename Number = float>
+class DefinitionGraph {
+public:
+	DefinitionGraph() : epoch(0) {
+	}
+
+	// Makes program the definition of the variable in slot, the previous program
+	// is swapped into program. Returns false and changes nothing if program reads
+	// slot or a definition that depends on it
+	bool Define(uint32_t slot, Program<Number>& program) {
+		Reserve(slot);
+		dependencies.clear();
+		for (const Instruction<Number>& instruction : program.GetInstructions()) {
+			if (instruction.op == OpCode::LOAD) {
+				dependencies.push_back(instruction.slot);
+			}
+		}
+		std::sort(dependencies.begin(), dependencies.end());
+		dependencies.erase(std::unique(dependencies.begin(), dependencies.end()), dependencies.end());
+
+		// Everything downstream of slot is marked with the current epoch
+		Walk(slot);
+		for (uint32_t dependency : dependencies) {
+			if (dependency < marks.size() && marks[dependency] == epoch) {
+				return false;
+			}
+		}
+
+		Detach(slot);
+		Node& node = nodes[slot];
+		node.program.Swap(program);
+		node.dependencies.swap(dependencies);
+		for (uint32_t dependency : node.dependencies) {
+			Reserve(dependency);
+			nodes[dependency].dependents.push_back(slot);
+		}
+		return true;
+	}
+
+	// The variable in slot holds a value that was set directly and is no longer
+	// defined by an expression
+	void Assign(uint32_t slot) {
+		if (slot < nodes.size()) {
+			Detach(slot);
+			nodes[slot].program.Clear();
+			nodes[slot].dependencies.clear();
+		}
+	}
+
+	// Runs the definition of slot, if it has one, and every definition downstream
+	// of it. Returns the number of definitions that were run
+	size_t Update(uint32_t slot, VirtualMachine<Number>& vm, Number* slots) {
+		if (slot >= nodes.size()) {
+			return 0;
+		}
+		Walk(slot);
+		size_t updated = 0;
+		// The walk leaves the nodes in post order, so every definition runs after
+		// the ones it reads
+		for (size_t i = order.size(); i-- > 0;) {
+			const Program<Number>& program = nodes[order[i]].program;
+			if (!program.GetInstructions().empty()) {
+				slots[order[i]] = vm.Execute(program, slots);
+				updated++;
+			}
+		}
+		return updated;
+	}
+
+	// Runs every definition once, after the definitions it reads. Returns the
+	// number of definitions that were run
+	size_t UpdateAll(VirtualMachine<Number>& vm, Number* slots) {
+		NextEpoch();
+		size_t updated = 0;
+		for (uint32_t root = 0; root < nodes.size(); root++) {
+			if (marks[root] == epoch) {
+				continue;
+			}
+			marks[root] = epoch;
+			stack.emplace_back(root, 0);
+			while (!stack.empty()) {
+				auto& [node, next] = stack.back();
+				const std::vector<uint32_t>& reads = nodes[node].dependencies;
+				if (next == reads.size()) {
+					const Program<Number>& program = nodes[node].program;
+					if (!program.GetInstructions().empty()) {
+						slots[node] = vm.Execute(program, slots);
+						updated++;
+					}
+					stack.pop_back();
+					continue;
+				}
+				uint32_t dependency = reads[next++];
+				if (marks[dependency] != epoch) {
+					marks[dependency] = epoch;
+					stack.emplace_back(dependency, 0);
+				}
+			}
+		}
+		return updated;
+	}
+
+	// The program that defines the variable in slot, or nullptr if its value was
+	// set directly
+	const Program<Number>* GetDefinition(uint32_t slot) const {
+		if (slot >= nodes.size() || nodes[slot].program.GetInstructions().empty()) {
+			return nullptr;
+		}
+		return &nodes[slot].program;
+	}
+
+private:
+	struct Node {
+		Program<Number> program;            // Empty for a value that was set directly
+		std::vector<uint32_t> dependencies; // Slots the program reads, each once
+		std::vector<uint32_t> dependents;   // Definitions that read this slot
+	};
+
+	// Indexed by slot, grown as variables are defined
+	std::vector<Node> nodes;
+	// Epoch of the last walk that reached every node, so marks never need clearing
+	std::vector<uint32_t> marks;
+	uint32_t epoch;
+	// Reused between calls so updates do not allocate
+	std::vector<uint32_t> order;
+	std::vector<std::pair<uint32_t, uint32_t>> stack;
+	std::vector<uint32_t> dependencies;
+
+private:
+	void Reserve(uint32_t slot) {
+		if (slot >= nodes.size()) {
+			nodes.resize(slot + 1);
+			marks.resize(slot + 1, epoch);
+		}
+	}
+
+	// Removes slot from the dependents of everything it reads
+	void Detach(uint32_t slot) {
+		for (uint32_t dependency : nodes[slot].dependencies) {
+			std::vector<uint32_t>& dependents = nodes[dependency].dependents;
+			dependents.erase(std::find(dependents.begin(), dependents.end(), slot));
+		}
+	}
+
+	void NextEpoch() {
+		if (++epoch == 0) {
+			// Marks from before the counter wrapped could match again
+			std::fill(marks.begin(), marks.end(), 0);
+			epoch = 1;
+		}
+	}
+
+	// Marks slot and everything downstream of it and lists them in post order.
+	// Chains of definitions can be thousands long, so this uses its own stack
+	void Walk(uint32_t slot) {
+		NextEpoch();
+		order.clear();
+		marks[slot] = epoch;
+		stack.emplace_back(slot, 0);
+		while (!stack.empty()) {
+			auto& [node, next] = stack.back();
+			const std::vector<uint32_t>& dependents = nodes[node].dependents;
+			if (next == dependents.size()) {
+				order.push_back(node);
+				stack.pop_back();
+				continue;
+			}
+			uint32_t dependent = dependents[next++];
+			if (marks[dependent] != epoch) {
+				marks[dependent] = epoch;
+				stack.emplace_back(dependent, 0);
+			}
+		}
+	}
+};
+
+// Compiled programs stored so a process can run them without parsing. The
+// image is position independent, every reference in it is an offset from its
+// start, so it can be mapped from a file and shared by every process that runs
+// it. Programs are found through a hash table in the image and run in place,
+// the literal of a PUSH is stored in it as the VM reads it, so opening an image
+// only checks it. An image holds the programs of one number type and byte order
+// and is rejected by any other. The programs of definitions are stored with the
+// names they define, and a calculator that opens the image runs them
+//
+// Layout: a Header, a NameRecord per variable in slot order, a ProgramRecord
+// per program, the hash table, every program's instructions and the text of
+// names and keys. Definitions come after the expressions and are not in the
+// hash table. The header holds a checksum of the whole image
+template <typename Number = float>
+class ProgramImage {
+public:
+	static constexpr uint32_t VERSION = 2;
+
+	ProgramImage() : data(nullptr), error(nullptr) {
+	}
+
+	ProgramImage(const ProgramImage&) = delete;
+	ProgramImage& operator=(const ProgramImage&) = delete;
+
+	// Appends the image of the programs, each compiled from the source that
+	// normalises to the key with the same index, against symbols. Keys must be
+	// distinct. definitions holds the program that defines each slot, or nullptr
+	// for a variable without one, and may be shorter than symbols
+	static void Write(const SymbolTable& symbols, const std::vector<const Program<Number>*>& definitions, const std::vector<std::string>& keys,
+					  const std::vector<Program<Number>>& programs, std::string& out) {
+		std::string strings;
+		std::vector<NameRecord> names(symbols.GetSize());
+		std::vector<const Program<Number>*> stored;
+		for (const Program<Number>& program : programs) {
+			stored.push_back(&program);
+		}
+		for (size_t i = 0; i < names.size(); i++) {
+			std::string_view name = symbols.GetName(static_cast<uint32_t>(i));
+			names[i] = NameRecord{strings.size(), name.size(), 0};
+			strings += name;
+			if (i < definitions.size() && definitions[i] != nullptr) {
+				stored.push_back(definitions[i]);
+				names[i].definition = stored.size();
+			}
+		}
+
+		// Half full at most, so lookups probe few buckets
+		uint64_t bucket_count = 0;
+		if (!programs.empty()) {
+			bucket_count = 1;
+			while (bucket_count < programs.size() * 2) {
+				bucket_count *= 2;
+			}
+		}
+		std::vector<uint64_t> buckets(bucket_count, 0);
+		std::vector<ProgramRecord> records(stored.size());
+		uint64_t instruction_count = 0;
+		for (size_t i = 0; i < stored.size(); i++) {
+			records[i].key = strings.size();
+			records[i].key_size = i < programs.size() ? keys[i].size() : 0;
+			records[i].first = instruction_count;
+			records[i].count = stored[i]->GetInstructions().size();
+			records[i].max_depth = static_cast<uint32_t>(stored[i]->GetMaxDepth());
+			records[i].temporaries = static_cast<uint32_t>(stored[i]->GetTemporaryCount());
+			instruction_count += records[i].count;
+			if (i >= programs.size()) {
+				continue;
+			}
+
+			strings += keys[i];
+			uint64_t bucket = Hash(keys[i]) & (bucket_count - 1);
+			while (buckets[bucket] != 0) {
+				bucket = (bucket + 1) & (bucket_count - 1);
+			}
+			buckets[bucket] = i + 1;
+		}
+
+		Header header = MakeHeader();
+		header.name_count = names.size();
+		header.program_count = records.size();
+		header.expression_count = programs.size();
+		header.bucket_count = bucket_count;
+		header.names = sizeof(Header);
+		header.programs = header.names + names.size() * sizeof(NameRecord);
+		header.buckets = header.programs + records.size() * sizeof(ProgramRecord);
+		header.instructions = AlignUp(header.buckets + bucket_count * sizeof(uint64_t));
+		header.strings = header.instructions + instruction_count * sizeof(Instruction<Number>);
+		header.size = header.strings + strings.size();
+
+		size_t start = out.size();
+		out.resize(start + header.size);
+		char* image = &out[start];
+		std::memcpy(image, &header, sizeof(Header));
+		std::memcpy(image + header.names, names.data(), names.size() * sizeof(NameRecord));
+		std::memcpy(image + header.programs, records.data(), records.size() * sizeof(ProgramRecord));
+		std::memcpy(image + header.buckets, buckets.data(), buckets.size() * sizeof(uint64_t));
+		char* instruction = image + header.instructions;
+		for (const Program<Number>* program : stored) {
+			for (const Instruction<Number>& source : program->GetInstructions()) {
+				WriteInstruction(source, instruction);
+				instruction += sizeof(Instruction<Number>);
+			}
+		}
+		std::memcpy(image + header.strings, strings.data(), strings.size());
+		header.checksum = Checksum(image, header.size);
+		std::memcpy(image + offsetof(Header, checksum), &header.checksum, sizeof(header.checksum));
+	}
+
+	// Checks every section and program of the image, which must be 64 byte
+	// aligned, as a mapping is, and stay in memory while it is open. Returns
+	// false if it is not a valid image for this number type, see GetError()
+	bool Open(const char* data, size_t size) {
+		this->data = nullptr;
+		names.clear();
+		if (size < sizeof(Header)) {
+			return Fail("not a compiled expression image");
+		}
+		std::memcpy(&header, data, sizeof(Header));
+		Header expected = MakeHeader();
+		if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0) {
+			return Fail("not a compiled expression image");
+		}
+		if (header.version != VERSION) {
+			return Fail("unsupported image version");
+		}
+		if (header.byte_order != expected.byte_order || header.number_size != expected.number_size ||
+			header.number_digits != expected.number_digits || header.instruction_size != expected.instruction_size) {
+			return Fail("image was compiled for another number type or machine");
+		}
+		if (reinterpret_cast<uintptr_t>(data) % ALIGNMENT != 0) {
+			return Fail("image is not aligned");
+		}
+
+		// Sections must be in order and inside the image, the counts are checked
+		// first so the section sizes cannot overflow
+		if (header.size != size || header.name_count > size || header.program_count > size || header.bucket_count > size ||
+			header.expression_count > header.program_count || header.names != sizeof(Header) ||
+			header.programs != header.names + header.name_count * sizeof(NameRecord) ||
+			header.buckets != header.programs + header.program_count * sizeof(ProgramRecord) ||
+			header.instructions < header.buckets + header.bucket_count * sizeof(uint64_t) || header.instructions % ALIGNMENT != 0 ||
+			header.strings < header.instructions || header.strings > size ||
+			(header.strings - header.instructions) % sizeof(Instruction<Number>) != 0 ||
+			(header.bucket_count & (header.bucket_count - 1)) != 0 || header.bucket_count < header.expression_count) {
+			return Fail("image is truncated or corrupt");
+		}
+		if (Checksum(data, size) != header.checksum) {
+			return Fail("image is truncated or corrupt");
+		}
+
+		uint64_t string_size = size - header.strings;
+		for (uint64_t i = 0; i < header.name_count; i++) {
+			NameRecord name;
+			std::memcpy(&name, data + header.names + i * sizeof(NameRecord), sizeof(NameRecord));
+			if (name.offset > string_size || name.size > string_size - name.offset || name.definition > header.program_count) {
+				return Fail("image is truncated or corrupt");
+			}
+			names.emplace_back(data + header.strings + name.offset, name.size);
+		}
+
+		const Instruction<Number>* instructions = reinterpret_cast<const Instruction<Number>*>(data + header.instructions);
+		uint64_t instruction_count = (header.strings - header.instructions) / sizeof(Instruction<Number>);
+		for (uint64_t i = 0; i < header.program_count; i++) {
+			ProgramRecord record = GetRecord(data, i);
+			if (record.key > string_size || record.key_size > string_size - record.key || record.first > instruction_count ||
+				record.count > instruction_count - record.first || !IsValid(instructions + record.first, record)) {
+				return Fail("image is truncated or corrupt");
+			}
+		}
+		for (uint64_t i = 0; i < header.bucket_count; i++) {
+			if (GetBucket(data, i) > header.expression_count) {
+				return Fail("image is truncated or corrupt");
+			}
+		}
+		this->data = data;
+		error = nullptr;
+		return true;
+	}
+
+	// Points program at the instructions compiled from source that normalises
+	// to key. Returns false if the image has none
+	bool Find(std::string_view key, Program<Number>& program) const {
+		if (data == nullptr || header.bucket_count == 0) {
+			return false;
+		}
+		uint64_t mask = header.bucket_count - 1;
+		// A full table has no empty bucket to stop at
+		for (uint64_t bucket = Hash(key) & mask, probes = 0; probes < header.bucket_count; bucket = (bucket + 1) & mask, probes++) {
+			uint64_t index = GetBucket(data, bucket);
+			if (index == 0) {
+				return false;
+			}
+			ProgramRecord record = GetRecord(data, index - 1);
+			if (key == std::string_view(data + header.strings + record.key, record.key_size)) {
+				const Instruction<Number>* instructions = reinterpret_cast<const Instruction<Number>*>(data + header.instructions);
+				program.Map(instructions + record.first, record.count, record.max_depth, record.temporaries);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Variables the programs were compiled against, in slot order
+	const std::vector<std::string_view>& GetNames() const {
+		return names;
+	}
+
+	// Points program at the definition of the variable in slot. Returns false if
+	// it had none when the image was written
+	bool GetDefinition(uint32_t slot, Program<Number>& program) const {
+		if (data == nullptr || slot >= header.name_count) {
+			return false;
+		}
+		NameRecord name;
+		std::memcpy(&name, data + header.names + slot * sizeof(NameRecord), sizeof(NameRecord));
+		if (name.definition == 0) {
+			return false;
+		}
+		ProgramRecord record = GetRecord(data, name.definition - 1);
+		const Instruction<Number>* instructions = reinterpret_cast<const Instruction<Number>*>(data + header.instructions);
+		program.Map(instructions + record.first, record.count, record.max_depth, record.temporaries);
+		return true;
+	}
+
+	// Expressions in the image, not counting definitions
+	size_t GetSize() const {
+		return data != nullptr ? header.expression_count : 0;
+	}
+
+	bool IsEmpty() const {
+		return GetSize() == 0;
+	}
+
+	// Why the last call to Open() failed
+	const char* GetError() const {
+		return error;
+	}
+
+private:
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t byte_order; // BYTE_ORDER_MARK in the writer's byte order
+		uint32_t number_size;
+		uint32_t number_digits;
+		uint32_t instruction_size;
+		uint32_t reserved;
+		uint64_t name_count;
+		uint64_t program_count;
+		uint64_t expression_count; // The programs before the definitions
+		uint64_t bucket_count; // A power of two, or 0 without programs
+		// Offsets of the sections and the size of the whole image
+		uint64_t names;
+		uint64_t programs;
+		uint64_t buckets;
+		uint64_t instructions;
+		uint64_t strings;
+		uint64_t size;
+		uint64_t checksum; // Of the whole image with this field as zero
+	};
+
+	// Offsets are from the start of the text section
+	struct NameRecord {
+		uint64_t offset;
+		uint64_t size;
+		uint64_t definition; // Index of the program that defines it plus one, 0 for none
+	};
+
+	struct ProgramRecord {
+		uint64_t key;
+		uint64_t key_size;
+		uint64_t first; // Index of the first instruction
+		uint64_t count;
+		uint32_t max_depth;
+		uint32_t temporaries;
+	};
+
+	static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+	// Instructions start on a cache line, which also suits every Number
+	static constexpr uint64_t ALIGNMENT = 64;
+	// x87 extended precision only uses the first 10 of its bytes, the rest are
+	// written as zeros so the same programs always give the same image
+	static constexpr size_t VALUE_SIZE = std::is_same<Number, long double>::value && std::numeric_limits<Number>::digits == 64 ? 10 : sizeof(Number);
+
+	const char* data;
+	const char* error;
+	Header header;
+	std::vector<std::string_view> names;
+
+private:
+	static Header MakeHeader() {
+		Header header = {};
+		std::memcpy(header.magic, "CALCIMG", 8);
+		header.version = VERSION;
+		header.byte_order = BYTE_ORDER_MARK;
+		header.number_size = sizeof(Number);
+		header.number_digits = std::numeric_limits<Number>::digits;
+		header.instruction_size = sizeof(Instruction<Number>);
+		return header;
+	}
+
+	static uint64_t AlignUp(uint64_t offset) {
+		return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+	}
+
+	// FNV-1a, which unlike std::hash is the same in every process. A hash can
+	// be continued by passing it back in
+	static uint64_t Hash(std::string_view key, uint64_t hash = 0xcbf29ce484222325) {
+		for (char ch : key) {
+			hash = (hash ^ static_cast<unsigned char>(ch)) * 0x100000001b3;
+		}
+		return hash;
+	}
+
+	// Catches corruption that leaves every section in bounds, such as a flipped
+	// literal. The checksum field hashes as zeros
+	static uint64_t Checksum(const char* image, uint64_t size) {
+		constexpr uint64_t FIELD = offsetof(Header, checksum);
+		const char zeros[sizeof(uint64_t)] = {};
+		uint64_t hash = Hash(std::string_view(image, FIELD));
+		hash = Hash(std::string_view(zeros, sizeof(zeros)), hash);
+		return Hash(std::string_view(image + FIELD + sizeof(uint64_t), size - FIELD - sizeof(uint64_t)), hash);
+	}
+
+	// Records are copied out, the sections are only 8 byte aligned
+	ProgramRecord GetRecord(const char* image, uint64_t index) const {
+		ProgramRecord record;
+		std::memcpy(&record, image + header.programs + index * sizeof(ProgramRecord), sizeof(ProgramRecord));
+		return record;
+	}
+
+	// Index of a program plus one, 0 for an empty bucket
+	uint64_t GetBucket(const char* image, uint64_t bucket) const {
+		uint64_t index;
+		std::memcpy(&index, image + header.buckets + bucket * sizeof(uint64_t), sizeof(uint64_t));
+		return index;
+	}
+
+	// Copies the fields of an instruction but not its padding
+	static void WriteInstruction(const Instruction<Number>& instruction, char* out) {
+		std::memset(out, 0, sizeof(Instruction<Number>));
+		std::memcpy(out + offsetof(Instruction<Number>, op), &instruction.op, sizeof(OpCode));
+		if (instruction.op == OpCode::PUSH) {
+			std::memcpy(out + offsetof(Instruction<Number>, value), &instruction.value, VALUE_SIZE);
+		} else {
+			std::memcpy(out + offsetof(Instruction<Number>, slot), &instruction.slot, sizeof(uint32_t));
+		}
+	}
+
+	// Programs run without bounds checks, so every instruction must be known and
+	// refer to a declared variable or temporary, and the stack must stay within
+	// max_depth and end with the result. Every temporary and stack entry needs
+	// an instruction, so a program cannot ask for more of them
+	bool IsValid(const Instruction<Number>* instructions, const ProgramRecord& record) const {
+		if (record.max_depth > record.count || record.temporaries > record.count) {
+			return false;
+		}
+		size_t depth = 0;
+		for (uint64_t i = 0; i < record.count; i++) {
+			const Instruction<Number>& instruction = instructions[i];
+			if (static_cast<uint8_t>(instruction.op) > static_cast<uint8_t>(OpCode::MAX)) {
+				return false;
+			}
+			if ((instruction.op == OpCode::LOAD && instruction.slot >= header.name_count) ||
+				((instruction.op == OpCode::STORE || instruction.op == OpCode::RECALL) && instruction.slot >= record.temporaries)) {
+				return false;
+			}
+			if (depth < GetArity(instruction.op)) {
+				return false;
+			}
+			depth += GetStackEffect(instruction.op);
+			if (depth > record.max_depth) {
+				return false;
+			}
+		}
+		return depth == 1;
+	}
+
+	bool Fail(const char* message) {
+		data = nullptr;
+		names.clear();
+		error = message;
+		return false;
+	}
+};
+
+// Settings of a Calculator
+struct CalculatorOptions {
+	size_t cache_size = 1024;             // Compiled programs kept, 0 disables the cache
+	size_t jit_threshold = 64;            // Cache hits before a program is compiled to native code, 0 disables the JIT
+	size_t max_depth = DEFAULT_MAX_DEPTH; // Deepest nesting of parentheses accepted, 0 disables the limit
+	size_t tree_threads = 1;              // Threads of a ParallelEvaluator for trees it splits, 1 compiles every tree
+	bool stats = false;                   // Record call counts and times of every stage
+	bool definitions = true;              // Accept "let name = expression" lines
+	std::string_view image;               // ProgramImage of precompiled expressions, must outlive the calculator
+};
+
+// Evaluates expressions for an embedding program. The parser arena, the program
+// being compiled, the cache and the VM stack are all kept between calls, so once
+// the cache has filled up (or holds every expression) evaluating does not
+// allocate. A calculator must only be used by one thread at a time
+template <typename Number = float>
+class Calculator {
+public:
+	// The variables of the image are declared first, so its programs read the
+	// right slots, and then its definitions are run. An invalid image is
+	// ignored, see GetImage()
+	Calculator(const CalculatorOptions& options = CalculatorOptions()) : options(options), cache(options.cache_size), stats(options.stats) {
+		if (options.tree_threads > 1) {
+			parallel.reset(new ParallelEvaluator<Number>(options.tree_threads));
+		}
+		if (!options.image.empty() && image.Open(options.image.data(), options.image.size())) {
+			for (std::string_view name : image.GetNames()) {
+				Declare(name);
+			}
+			// A circular definition can only come from a forged image, it is dropped
+			for (uint32_t slot = 0; slot < image.GetNames().size(); slot++) {
+				if (image.GetDefinition(slot, program)) {
+					definitions.Define(slot, program);
+				}
+			}
+			definitions.UpdateAll(vm, slots.data());
+		}
+	}
+
+	Calculator(const Calculator&) = delete;
+	Calculator& operator=(const Calculator&) = delete;
+
+	// Evaluates one expression or definition into result. A returned error refers
+	// to source, so it is only valid as long as source is
+	Error Evaluate(std::string_view source, Number& result) {
+		stats.AddLine(source.size());
+		if (IsDefinition(source)) {
+			return Define(source, result);
+		}
+
+		bool use_cache = cache.IsEnabled();
+		if (use_cache || !image.IsEmpty()) {
+			uint64_t time = stats.Start();
+			ProgramCache<Number>::Normalise(source, key);
+			typename ProgramCache<Number>::Entry* entry = use_cache ? cache.Find(key) : nullptr;
+			if (entry != nullptr) {
+				// Tiering up is counted as part of the lookup
+				const JitFunction<Number>* jit = cache.Tier(*entry, options.jit_threshold);
+				time = stats.Record(Stats::LOOKUP, time);
+				result = jit != nullptr ? (*jit)(slots.data()) : vm.Execute(entry->program, slots.data());
+				stats.Record(Stats::EXECUTE, time);
+				return Error(Error::Type::NO_ERROR, 0, source);
+			}
+			// Programs of the image are cached like compiled ones, so they still
+			// tier up. They keep running the image's instructions in place
+			if (image.Find(key, program)) {
+				time = stats.Record(Stats::LOOKUP, time);
+				result = vm.Execute(program, slots.data());
+				time = stats.Record(Stats::EXECUTE, time);
+				if (use_cache) {
+					cache.Insert(key, program);
+					stats.Record(Stats::LOOKUP, time, 0);
+				}
+				return Error(Error::Type::NO_ERROR, 0, source);
+			}
+			stats.Record(Stats::LOOKUP, time);
+		}
+
+		const Expression<Number>* tree = nullptr;
+		Error error = ParseSource(source, tree);
+		if (error) {
+			return error;
+		}
+		// A tree large enough to split runs on the parallel evaluator's threads
+		// rather than the VM, so it is neither compiled nor cached
+		if (parallel != nullptr && parallel->Splits(tree)) {
+			uint64_t time = stats.Start();
+			result = parallel->Evaluate(tree, slots.data());
+			stats.Record(Stats::EXECUTE, time);
+			return error;
+		}
+		CompileTree(tree, program);
+
+		uint64_t time = stats.Start();
+		result = vm.Execute(program, slots.data());
+		time = stats.Record(Stats::EXECUTE, time);
+		if (use_cache) {
+			cache.Insert(key, program);
+			stats.Record(Stats::LOOKUP, time, 0);
+		}
+		return error;
+	}
+
+	// Parses and compiles an expression without running it, definitions are not
+	// accepted. The program reads the calculator's slots
+	Error Compile(std::string_view source, Program<Number>& target) {
+		stats.AddLine(source.size());
+		return CompileSource(source, target);
+	}
+
+	// Whether source is a "let name = expression" line, which Evaluate() handles
+	// as a definition
+	bool IsDefinition(std::string_view source) const {
+		size_t start = SkipSpaces(source, 0);
+		return options.definitions && source.compare(start, 3, "let") == 0 && start + 3 < source.size() &&
+			   IsSpace(source[start + 3]);
+	}
+
+	// Declares a variable or changes its value, replacing its definition if it
+	// had one. Programs read variables when they run, so cached expressions see
+	// the new value and definitions that read it are updated
+	void SetVariable(std::string_view name, Number value) {
+		uint32_t slot = Declare(name);
+		slots[slot] = value;
+		definitions.Assign(slot);
+		definitions.Update(slot, vm, slots.data());
+	}
+
+	// Adds the cache counters and stats of a calculator that ran on another thread
+	void MergeCounters(const Calculator& other) {
+		cache.MergeCounters(other.cache);
+		stats.Merge(other.stats);
+	}
+
+	const CalculatorOptions& GetOptions() const {
+		return options;
+	}
+
+	const SymbolTable& GetSymbols() const {
+		return symbols;
+	}
+
+	// The program that defines the variable in slot, or nullptr if it has none
+	const Program<Number>* GetDefinition(uint32_t slot) const {
+		return definitions.GetDefinition(slot);
+	}
+
+	// Values of the declared variables, indexed by slot
+	const Number* GetSlots() const {
+		return slots.data();
+	}
+
+	const ProgramCache<Number>& GetCache() const {
+		return cache;
+	}
+
+	// Empty if the options had no image, or an invalid one
+	const ProgramImage<Number>& GetImage() const {
+		return image;
+	}
+
+	Stats& GetStats() {
+		return stats;
+	}
+
+	const Stats& GetStats() const {
+		return stats;
+	}
+
+private:
+	CalculatorOptions options;
+	ProgramCache<Number> cache;
+	Stats stats;
+	VirtualMachine<Number> vm;
+	Arena arena;
+	Program<Number> program;
+	std::string key;
+	SymbolTable symbols;
+	std::vector<Number> slots;
+	DefinitionGraph<Number> definitions;
+	ProgramImage<Number> image;
+	std::unique_ptr<ParallelEvaluator<Number>> parallel;
+
+private:
+	static bool IsSpace(char ch) {
+		return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' || ch == '\f' || ch == '\v';
+	}
+
+	static bool IsNameChar(char ch) {
+		return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_';
+	}
+
+	static size_t SkipSpaces(std::string_view source, size_t position) {
+		while (position < source.size() && IsSpace(source[position])) {
+			position++;
+		}
+		return position;
+	}
+
+	uint32_t Declare(std::string_view name) {
+		uint32_t slot = symbols.Declare(name);
+		if (slot >= slots.size()) {
+			slots.resize(slot + 1);
+		}
+		return slot;
+	}
+
+	// Parses and optimises source, the tree lives in the calculator's arena until
+	// the next source is parsed
+	Error ParseSource(std::string_view source, const Expression<Number>*& tree) {
+		uint64_t time = stats.Start();
+		arena.Reset();
+		Lexer<Number> lexer(source);
+		StreamingParser<Number> parser(lexer, source, symbols, options.max_depth, &arena);
+		Error error = parser.Parse();
+		time = stats.Record(Stats::PARSE, time);
+
+		if (error) {
+			stats.AddError();
+			return error;
+		}
+
+		stats.AddExpression(parser.GetAST());
+		time = stats.Start();
+		parser.Optimize();
+		stats.Record(Stats::OPTIMIZE, time);
+		tree = parser.GetAST();
+		return error;
+	}
+
+	void CompileTree(const Expression<Number>* tree, Program<Number>& target) {
+		uint64_t time = stats.Start();
+		target.Clear();
+		tree->Compile(target);
+		stats.Record(Stats::COMPILE, time);
+	}
+
+	// Parses, optimises and compiles source into target
+	Error CompileSource(std::string_view source, Program<Number>& target) {
+		const Expression<Number>* tree = nullptr;
+		Error error = ParseSource(source, tree);
+		if (!error) {
+			CompileTree(tree, target);
+		}
+		return error;
+	}
+
+	// "let name = expression", the result is the new value of name. The
+	// expression may only read variables that are already declared, so a name
+	// cannot be defined in terms of itself
+	Error Define(std::string_view source, Number& result) {
+		size_t position = SkipSpaces(source, SkipSpaces(source, 0) + 3);
+		size_t name_start = position;
+		if (position < source.size() && !(source[position] >= '0' && source[position] <= '9')) {
+			while (position < source.size() && IsNameChar(source[position])) {
+				position++;
+			}
+		}
+		std::string_view name = source.substr(name_start, position - name_start);
+		position = SkipSpaces(source, position);
+		if (name.empty() || position == source.size() || source[position] != '=') {
+			stats.AddError();
+			Error::Type type = position == source.size() ? Error::Type::END_OF_STREAM : Error::Type::INVALID_TOKEN;
+			return Error(type, position, source);
+		}
+
+		// Errors in the expression point into the whole line
+		size_t offset = position + 1;
+		Error error = CompileSource(source.substr(offset), program);
+		if (error) {
+			error.location += offset;
+			error.source = source;
+			return error;
+		}
+
+		uint32_t slot = Declare(name);
+		if (!definitions.Define(slot, program)) {
+			stats.AddError();
+			return Error(Error::Type::CIRCULAR_DEFINITION, name_start, source);
+		}
+		uint64_t time = stats.Start();
+		definitions.Update(slot, vm, slots.data());
+		stats.Record(Stats::EXECUTE, time);
+		result = slots[slot];
+		return error;
+	}
+};
+
+// Instantiated once in the library, programs that link it do not compile these
+// again
+extern template class Calculator<float>;
+extern template class Calculator<double>;
+extern template class Calculator<long double>;
+extern template Error Compile(std::string_view source, const SymbolTable& symbols, Program<float>& program);
+extern template Error Compile(std::string_view source, const SymbolTable& symbols, Program<double>& program);
+extern template Error Compile(std::string_view source, const SymbolTable& symbols, Program<long double>& program);
@@ -0,0 +1,22 @@
+// Explicit instantiations of the engine for every number type the command line
+// supports, built into libcalculator.a and libcalculator.so
+#include "calculator.h"
+
+template class Calculator<float>;
+template class Calculator<double>;
+template class Calculator<long double>;
+template Error Compile(std::string_view source, const SymbolTable& symbols, Program<float>& program);
+template Error Compile(std::string_view source, const SymbolTable& symbols, Program<double>& program);
+template Error Compile(std::string_view source, const SymbolTable& symbols, Program<long double>& program);
+
+CALCULATOR_SIMD_CLONES
+void ExecuteSimdBlock(const Instruction<float>* instructions, size_t size, const float* const* columns, size_t row, size_t count, SimdLanes<float>::Type* stack,
+					  SimdLanes<float>::Type* temporaries) {
+	ExecuteColumnBlock(instructions, size, columns, row, count, stack, temporaries);
+}
+
+CALCULATOR_SIMD_CLONES
+void ExecuteSimdBlock(const Instruction<double>* instructions, size_t size, const double* const* columns, size_t row, size_t count, SimdLanes<double>::Type* stack,
+					  SimdLanes<double>::Type* temporaries) {
+	ExecuteColumnBlock(instructions, size, columns, row, count, stack, temporaries);
+}